@@ -0,0 +1,72 @@
+/* The buffer pool, with thread-local free lists per size class. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "bufpool.h"
+
+#define NCLASSES 14           /* POOL_MIN << 13 == POOL_MAX */
+
+/* Sits in front of every buffer. */
+struct header {
+    size_t size;
+    size_t pad;               /* keeps the buffer 16-byte aligned */
+};
+
+/* a free buffer links to the next one through its first bytes */
+__thread char* freeList[NCLASSES];
+__thread int nFree[NCLASSES];
+
+/* The free buffers class c keeps at most. */
+int keepOf(int c) {
+    int keep = POOL_KEEP_BYTES / ((size_t) POOL_MIN << c);
+    if (keep < 1) { return 1; }
+    return keep < POOL_KEEP ? keep : POOL_KEEP;
+}
+
+/* The smallest class holding size bytes, NCLASSES if none does. */
+int sizeClass(size_t size) {
+    int c = 0;
+    while (c < NCLASSES && ((size_t) POOL_MIN << c) < size) { c++; }
+    return c;
+}
+
+char* poolAlloc(size_t size) {
+    int c = sizeClass(size);
+    struct header* h;
+    if (c < NCLASSES && freeList[c] != NULL) {
+        char* buf = freeList[c];
+        memcpy(&freeList[c], buf, sizeof(char*));
+        nFree[c]--;
+        return buf;
+    }
+    if (c < NCLASSES) { size = (size_t) POOL_MIN << c; }
+    h = malloc(sizeof(struct header) + size);
+    if (h == NULL) { return NULL; }
+    h->size = size;
+    return (char*) (h + 1);
+}
+
+size_t poolSize(const char* buf) {
+    return ((const struct header*) buf - 1)->size;
+}
+
+void poolFree(char* buf) {
+    if (buf == NULL) { return; }
+    size_t size = poolSize(buf);
+    int c = sizeClass(size);
+    if (c < NCLASSES && ((size_t) POOL_MIN << c) == size && nFree[c] < keepOf(c)) {
+        memcpy(buf, &freeList[c], sizeof(char*));
+        freeList[c] = buf;
+        nFree[c]++;
+        return;
+    }
+    free((struct header*) buf - 1);
+}
+
+char* poolGrow(char* buf, size_t len, size_t size) {
+    char* bigger = poolAlloc(size);
+    if (bigger == NULL) { return NULL; }
+    memcpy(bigger, buf, len);
+    poolFree(buf);
+    return bigger;
+}
@@ -0,0 +1,43 @@
+/* Header file for the buffer pool.
+ * Buffers come in power-of-two classes from POOL_MIN to POOL_MAX
+ * bytes. Freed buffers go on a free list of the freeing thread and
+ * are handed out again by that thread without calling malloc, so a
+ * session can grow its buffers to fit large commands cheaply. A class
+ * keeps at most POOL_KEEP buffers and POOL_KEEP_BYTES bytes, but at
+ * least one buffer, so a thread holds at most about 5MB of free buffers.
+ * Larger buffers are malloced and freed directly.
+ */
+
+#ifndef _bufpool_h_
+#define _bufpool_h_
+
+#include <stddef.h>
+
+#define POOL_MIN 256
+#define POOL_MAX (1 << 21)
+#define POOL_KEEP 32      /* free buffers kept per class and thread */
+#define POOL_KEEP_BYTES (1 << 18)  /* and free bytes */
+
+/*
+ * Get a buffer of at least size bytes.
+ * RETURNS: the buffer, NULL if out of memory.
+ */
+char* poolAlloc(size_t size);
+
+/*
+ * RETURNS: the number of bytes buf can hold.
+ */
+size_t poolSize(const char* buf);
+
+/*
+ * Give a buffer back to the pool, NULL is ignored.
+ */
+void poolFree(char* buf);
+
+/*
+ * Move the first len bytes of buf to a buffer of at least size bytes.
+ * RETURNS: the new buffer, NULL if out of memory (buf is then kept).
+ */
+char* poolGrow(char* buf, size_t len, size_t size);
+
+#endif
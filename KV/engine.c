@@ -0,0 +1,573 @@
+/* Event driven I/O engines for the data port.
+ * The io_uring engine talks to the kernel through the raw system
+ * calls, the epoll engine is the fallback where io_uring is missing.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include "engine.h"
+#include "session.h"
+
+#define ENGINE_TICK 100
+#define RING_ENTRIES 256
+#define NBUFS 256
+#define BUFSZ 256
+#define BGID 1
+
+/* What a connection is waiting for. */
+enum CONN_STATE { C_IDLE, C_RECV, C_SEND, C_CLOSE };
+
+struct conn {
+    Session s;
+    in_addr_t addr;
+    enum CONN_STATE state;
+    struct msghdr msg;         /* the send in flight, io_uring reads it late */
+    int first;                 /* first segment not fully sent */
+};
+
+struct conn *conns[MAX_SESSIONS];
+int nconns = 0;
+
+/*
+* This function admits a freshly accepted connection
+* returns its slot, or -1 if the client was turned away
+*/
+int newConn(int fd){
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    struct conn *c;
+    int slot;
+    memset(&peer, 0, len);
+    getpeername(fd, (struct sockaddr *) &peer, &len);
+    if(admitClient(peer.sin_addr.s_addr) < 0){
+        printf("Client %s over connection limit, rejected\n", inet_ntoa(peer.sin_addr));
+        rejectConnection(fd, "Too many connections, try again later\n");
+        return -1;
+    }
+    for(slot = 0; slot < MAX_SESSIONS && conns[slot] != NULL; slot++);
+    c = slot < MAX_SESSIONS ? malloc(sizeof(struct conn)) : NULL;
+    if(c == NULL){
+        printf("Sessions full, rejected connection %d\n", fd);
+        releaseClient(peer.sin_addr.s_addr);
+        rejectConnection(fd, "Server busy, try again later\n");
+        return -1;
+    }
+    initSession(&c->s, fd);
+    c->addr = peer.sin_addr.s_addr;
+    c->state = C_IDLE;
+    c->first = 0;
+    conns[slot] = c;
+    nconns++;
+    return slot;
+}
+
+/*
+* This function closes a connection and frees its slot
+* close_it is zero when the descriptor was already closed
+*/
+void dropConn(int slot, int close_it){
+    struct conn *c = conns[slot];
+    endSession(&c->s);
+    if(close_it){
+        close(c->s.fd);
+    }
+    releaseClient(c->addr);
+    free(c);
+    conns[slot] = NULL;
+    nconns--;
+}
+
+/*
+* This function accounts for n bytes of the queued replies being sent
+* returns 1 once everything has been sent
+*/
+int advanceOutput(struct conn *c, size_t n){
+    Session *s = &c->s;
+    while(c->first < s->nseg && n >= s->iov[c->first].iov_len){
+        n -= s->iov[c->first].iov_len;
+        c->first++;
+    }
+    if(c->first == s->nseg){
+        c->first = 0;
+        releaseOutput(s);
+        return 1;
+    }
+    s->iov[c->first].iov_base = (char *) s->iov[c->first].iov_base + n;
+    s->iov[c->first].iov_len -= n;
+    return 0;
+}
+
+/* ----- epoll engine ----- */
+
+#define EV_LISTEN MAX_SESSIONS
+#define EV_WAKE (MAX_SESSIONS + 1)
+
+/*
+* This function executes the commands a connection has buffered
+* and writes the replies without blocking, a connection whose
+* replies don't fit in the socket waits for EPOLLOUT
+*/
+void epollServe(int epfd, int slot){
+    struct conn *c = conns[slot];
+    Session *s = &c->s;
+    struct epoll_event ev;
+    ssize_t n;
+    while(1){
+        if(s->nseg == 0 && (s->ended || runCommands(s) == 0)){
+            break;
+        }
+        n = writev(s->fd, s->iov + c->first, s->nseg - c->first);
+        if(n < 0 && errno != EAGAIN){
+            dropConn(slot, 1);
+            return;
+        }
+        if(!advanceOutput(c, n < 0 ? 0 : n)){
+            // stop reading until the client catches up
+            c->state = C_SEND;
+            ev.events = EPOLLOUT;
+            ev.data.u32 = slot;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+            return;
+        }
+    }
+    if(s->ended){
+        dropConn(slot, 1);
+        return;
+    }
+    if(c->state != C_RECV){
+        c->state = C_RECV;
+        ev.events = EPOLLIN;
+        ev.data.u32 = slot;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    }
+}
+
+/*
+* This function is the epoll engine
+* sockets are non-blocking and every session is served from this loop
+*/
+void epollEngine(int listenfd, int wakefd){
+    struct epoll_event ev, events[64];
+    struct conn *c;
+    int epfd, n, fd, slot, room, draining = 0;
+    ssize_t r;
+    char *at;
+    epfd = epoll_create1(0);
+    if(epfd < 0){
+        printf("Error creating epoll instance\n");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_LISTEN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.data.u32 = EV_WAKE;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    printf("Engine: epoll\n");
+    while(!draining || nconns > 0){
+        n = epoll_wait(epfd, events, 64, draining ? ENGINE_TICK : -1);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            printf("Error waiting on epoll\n");
+            exit(1);
+        }
+        for(int i=0; i<n; i++){
+            slot = events[i].data.u32;
+            if(slot == EV_LISTEN){
+                while((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0){
+                    slot = newConn(fd);
+                    if(slot < 0){
+                        continue;
+                    }
+                    conns[slot]->state = C_RECV;
+                    ev.events = EPOLLIN;
+                    ev.data.u32 = slot;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                    // the welcome banner is queued by initSession
+                    epollServe(epfd, slot);
+                }
+            }
+            else if(slot == EV_WAKE){
+                // stop accepting and start the drain
+                beginDrain();
+                draining = 1;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, wakefd, NULL);
+            }
+            else if(conns[slot] != NULL){
+                c = conns[slot];
+                if(c->state == C_RECV){
+                    at = sessionInput(&c->s, &room);
+                    r = read(c->s.fd, at, room);
+                    if(r == 0 || (r < 0 && errno != EAGAIN)){
+                        dropConn(slot, 1);
+                        continue;
+                    }
+                    c->s.len += r < 0 ? 0 : r;
+                }
+                epollServe(epfd, slot);
+            }
+        }
+        if(draining){
+            // in-flight commands are finished, idle sessions are closed
+            for(slot = 0; slot < MAX_SESSIONS; slot++){
+                c = conns[slot];
+                if(c == NULL){
+                    continue;
+                }
+                if(c->state == C_RECV || now_ms() >= drain_deadline){
+                    send(c->s.fd, "Server shutting down\n", 21, MSG_DONTWAIT | MSG_NOSIGNAL);
+                    dropConn(slot, 1);
+                }
+            }
+        }
+    }
+    close(epfd);
+}
+
+/* ----- io_uring engine ----- */
+
+enum URING_OP { U_ACCEPT, U_WAKE, U_RECV, U_SEND, U_CLOSE, U_TICK };
+
+#define UDATA(op, slot) (((uint64_t) (op) << 32) | (uint32_t) (slot))
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;           /* sqes not yet submitted */
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned short br_tail;
+};
+
+int uringEnter(struct uring *u, unsigned wait){
+    int n = syscall(__NR_io_uring_enter, u->fd, u->queued, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(n >= 0){
+        u->queued -= n;
+    }
+    return n;
+}
+
+/*
+* This function hands a provided buffer (back) to the kernel
+*/
+void uringRecycle(struct uring *u, int bid){
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (NBUFS - 1)];
+    b->addr = (uint64_t) (uintptr_t) (u->bufs + bid * BUFSZ);
+    b->len = BUFSZ;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+* This function sets up the ring and the provided buffer ring
+* returns 0 on success and -1 if io_uring isn't available
+*/
+int uringInit(struct uring *u){
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    char *sq, *cq;
+    size_t sqlen, cqlen;
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if(u->fd < 0){
+        return -1;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)){
+        close(u->fd);
+        return -1;
+    }
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(cqlen > sqlen){
+        sqlen = cqlen;
+    }
+    sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if(sq == MAP_FAILED || u->sqes == MAP_FAILED){
+        close(u->fd);
+        return -1;
+    }
+    cq = sq;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + p.sq_off.array);
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    u->queued = 0;
+    // receive buffers are picked by the kernel from a shared ring
+    u->br = mmap(NULL, NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs = malloc(NBUFS * BUFSZ);
+    if(u->br == MAP_FAILED || u->bufs == NULL){
+        close(u->fd);
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+    reg.ring_entries = NBUFS;
+    reg.bgid = BGID;
+    if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        close(u->fd);
+        return -1;
+    }
+    u->br_tail = 0;
+    for(int i=0; i<NBUFS; i++){
+        uringRecycle(u, i);
+    }
+    return 0;
+}
+
+/*
+* This function returns the next free sqe, submitting
+* the queued ones first if the ring is full
+*/
+struct io_uring_sqe *uringSqe(struct uring *u, int op, int slot, int fd){
+    unsigned tail = *u->sq_tail, index;
+    struct io_uring_sqe *sqe;
+    while(tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= RING_ENTRIES){
+        uringEnter(u, 0);
+    }
+    index = tail & *u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = UDATA(op, slot);
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+void uringAccept(struct uring *u, int listenfd){
+    struct io_uring_sqe *sqe = uringSqe(u, U_ACCEPT, 0, listenfd);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uringRecv(struct uring *u, int slot){
+    struct conn *c = conns[slot];
+    struct io_uring_sqe *sqe = uringSqe(u, U_RECV, slot, c->s.fd);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    sqe->len = BUFSZ;
+    c->state = C_RECV;
+}
+
+/*
+* This function sends the queued replies of a connection
+* the final reply of a session is linked to the close
+*/
+void uringSend(struct uring *u, int slot){
+    struct conn *c = conns[slot];
+    struct io_uring_sqe *sqe = uringSqe(u, U_SEND, slot, c->s.fd);
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->s.iov + c->first;
+    c->msg.msg_iovlen = c->s.nseg - c->first;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t) (uintptr_t) &c->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    c->state = C_SEND;
+    if(c->s.ended){
+        sqe->flags = IOSQE_IO_LINK;
+        sqe = uringSqe(u, U_CLOSE, slot, c->s.fd);
+        sqe->opcode = IORING_OP_CLOSE;
+        c->state = C_CLOSE;
+    }
+}
+
+/*
+* This function executes the buffered commands of a connection
+* and sends the replies, or waits for more input
+*/
+void uringServe(struct uring *u, int slot, int draining){
+    Session *s = &conns[slot]->s;
+    if(runCommands(s) > 0 || s->nseg > 0){
+        uringSend(u, slot);
+    }
+    else if(draining){
+        // nothing in flight any more, say goodbye
+        sessionText(s, "Server shutting down\n");
+        s->ended = 1;
+        uringSend(u, slot);
+    }
+    else{
+        uringRecv(u, slot);
+    }
+}
+
+void uringTick(struct uring *u, struct __kernel_timespec *ts){
+    struct io_uring_sqe *sqe = uringSqe(u, U_TICK, 0, -1);
+    ts->tv_sec = 0;
+    ts->tv_nsec = ENGINE_TICK * 1000000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) ts;
+    sqe->len = 1;
+}
+
+/*
+* This function is the io_uring engine
+* accepts arrive from one multishot accept, receives use buffers
+* picked by the kernel and the submissions queued while handling
+* a batch of completions go to the kernel in one system call
+* returns -1 if io_uring is not available
+*/
+int uringEngine(int listenfd, int wakefd){
+    struct uring u;
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec ts;
+    struct conn *c;
+    unsigned head, tail;
+    int op, slot, res, flags, bid, room, draining = 0;
+    if(uringInit(&u) < 0){
+        return -1;
+    }
+    printf("Engine: io_uring\n");
+    uringAccept(&u, listenfd);
+    sqe = uringSqe(&u, U_WAKE, 0, wakefd);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLIN;
+    while(!draining || nconns > 0){
+        if(uringEnter(&u, 1) < 0 && errno != EINTR){
+            printf("Error entering io_uring\n");
+            exit(1);
+        }
+        head = *u.cq_head;
+        tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++){
+            cqe = &u.cqes[head & *u.cq_mask];
+            op = cqe->user_data >> 32;
+            slot = (uint32_t) cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            c = op == U_RECV || op == U_SEND || op == U_CLOSE ? conns[slot] : NULL;
+            if(op == U_ACCEPT){
+                if(res >= 0){
+                    slot = newConn(res);
+                    if(slot >= 0){
+                        // send the welcome banner queued by initSession
+                        uringServe(&u, slot, 0);
+                    }
+                }
+                if(!(flags & IORING_CQE_F_MORE) && !draining){
+                    uringAccept(&u, listenfd);
+                }
+            }
+            else if(op == U_WAKE){
+                // stop accepting and start the drain
+                beginDrain();
+                draining = 1;
+                shutdown(listenfd, SHUT_RD);
+                // an idle session's receive ends at once
+                for(slot = 0; slot < MAX_SESSIONS; slot++){
+                    if(conns[slot] != NULL && conns[slot]->state == C_RECV && conns[slot]->s.len == 0){
+                        shutdown(conns[slot]->s.fd, SHUT_RD);
+                    }
+                }
+                uringTick(&u, &ts);
+            }
+            else if(op == U_TICK){
+                // past the deadline every remaining session is cut off
+                if(now_ms() >= drain_deadline){
+                    for(slot = 0; slot < MAX_SESSIONS; slot++){
+                        if(conns[slot] != NULL && conns[slot]->state != C_CLOSE){
+                            shutdown(conns[slot]->s.fd, SHUT_RDWR);
+                        }
+                    }
+                }
+                if(nconns > 0){
+                    uringTick(&u, &ts);
+                }
+            }
+            else if(op == U_RECV){
+                if(flags & IORING_CQE_F_BUFFER){
+                    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                    if(res > 0){
+                        // IN_ROOM covers a whole provided buffer
+                        memcpy(sessionInput(&c->s, &room), u.bufs + bid * BUFSZ, res);
+                        c->s.len += res;
+                    }
+                    uringRecycle(&u, bid);
+                }
+                if(res == -ENOBUFS){
+                    uringRecv(&u, slot);
+                }
+                else if(res <= 0 && draining && c->s.len == 0 && now_ms() < drain_deadline){
+                    uringServe(&u, slot, draining);
+                }
+                else if(res <= 0){
+                    dropConn(slot, 1);
+                }
+                else{
+                    uringServe(&u, slot, 0);
+                }
+            }
+            else if(op == U_SEND){
+                if(c->state == C_CLOSE){
+                    // the linked close reports on its own
+                    releaseOutput(&c->s);
+                }
+                else if(res < 0){
+                    dropConn(slot, 1);
+                }
+                else if(!advanceOutput(c, res)){
+                    uringSend(&u, slot);
+                }
+                else if(draining && now_ms() >= drain_deadline){
+                    dropConn(slot, 1);
+                }
+                else{
+                    uringServe(&u, slot, draining);
+                }
+            }
+            else if(op == U_CLOSE){
+                // a failed send cancels the linked close
+                dropConn(slot, res == -ECANCELED);
+            }
+        }
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+    }
+    close(u.fd);
+    free(u.bufs);
+    return 0;
+}
+
+void runEngine(enum ENGINE kind, int listenfd, int wakefd){
+    if(kind == E_URING && uringEngine(listenfd, wakefd) == 0){
+        return;
+    }
+    if(kind == E_URING){
+        printf("io_uring is not available, falling back to epoll\n");
+    }
+    if(fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0){
+        printf("Error setting data port non-blocking\n");
+        exit(1);
+    }
+    epollEngine(listenfd, wakefd);
+}
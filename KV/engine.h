@@ -0,0 +1,32 @@
+/* Header file for the event driven I/O engines.
+ * An engine serves every data connection from a single event loop
+ * instead of one worker thread per connection, using the same
+ * session code and command dispatch as the workers.
+ */
+
+#ifndef _engine_h_
+#define _engine_h_
+
+#include <netinet/in.h>
+
+#define MAX_SESSIONS 1024
+
+enum ENGINE { E_THREADS, E_EPOLL, E_URING };
+
+/*
+ * Serve the data port until the wake fd becomes readable, then drain
+ * the open sessions and return. E_URING uses io_uring with multishot
+ * accept and provided buffers and falls back to E_EPOLL when the
+ * kernel doesn't support it.
+ */
+void runEngine(enum ENGINE kind, int listenfd, int wakefd);
+
+/* Provided by the server. */
+long now_ms();
+int admitClient(in_addr_t addr);
+void releaseClient(in_addr_t addr);
+void rejectConnection(int conn, const char *reason);
+void beginDrain();
+extern long drain_deadline;
+
+#endif
@@ -0,0 +1,82 @@
+/* Epoch based reclamation for the lock-free readers of the store. */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "epoch.h"
+
+#define RETIRE_BATCH 64
+
+/* One slot per reader thread, the epoch it entered at or 0. */
+struct reader {
+    unsigned long epoch;
+    char pad[64 - sizeof(unsigned long)];
+} __attribute__((aligned(64)));
+
+struct retired {
+    void* p;
+    void (*fn)(void*);
+    unsigned long epoch;
+    struct retired* next;
+};
+
+struct reader readers[MAX_READERS];
+int nReaders = 0;
+__thread int self = -1;
+
+unsigned long globalEpoch = 1;
+
+pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+struct retired* limbo = NULL;
+int nLimbo = 0;
+
+int epochEnter() {
+    if (self < 0) {
+        int slot = __atomic_fetch_add(&nReaders, 1, __ATOMIC_RELAXED);
+        if (slot >= MAX_READERS) { return -1; }
+        self = slot;
+    }
+    /* the announcement must be visible before any load of the store */
+    __atomic_store_n(&readers[self].epoch, __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 0;
+}
+
+void epochExit() {
+    __atomic_store_n(&readers[self].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Free the retired memory that no active reader can see, under retire_lock. */
+void collect() {
+    unsigned long oldest = __atomic_add_fetch(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+    int n = __atomic_load_n(&nReaders, __ATOMIC_ACQUIRE);
+    if (n > MAX_READERS) { n = MAX_READERS; }
+    for (int i = 0; i < n; i++) {
+        unsigned long e = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (e != 0 && e < oldest) { oldest = e; }
+    }
+    struct retired** p = &limbo;
+    while (*p != NULL) {
+        struct retired* r = *p;
+        if (r->epoch < oldest) {
+            *p = r->next;
+            r->fn(r->p);
+            free(r);
+            nLimbo--;
+        } else {
+            p = &r->next;
+        }
+    }
+}
+
+void epochRetire(void* p, void (*fn)(void*)) {
+    struct retired* r = malloc(sizeof(struct retired));
+    if (r == NULL) { return; }  /* leak rather than free too early */
+    r->p = p;
+    r->fn = fn;
+    pthread_mutex_lock(&retire_lock);
+    r->epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    r->next = limbo;
+    limbo = r;
+    if (++nLimbo >= RETIRE_BATCH) { collect(); }
+    pthread_mutex_unlock(&retire_lock);
+}
@@ -0,0 +1,31 @@
+/* Header file for epoch based reclamation.
+ * Lock-free readers of the store announce themselves with epochEnter
+ * and epochExit. Memory a reader may still be looking at is handed to
+ * epochRetire instead of free, and freed once every reader that was
+ * active when it was retired has left.
+ */
+
+#ifndef _epoch_h_
+#define _epoch_h_
+
+#define MAX_READERS 256
+
+/*
+ * Start a lock-free read.
+ * RETURNS: 0 on success, (-1) if the thread could not be registered
+ * (more than MAX_READERS threads), the caller must then take the lock.
+ */
+int epochEnter();
+
+/*
+ * End a lock-free read started with epochEnter.
+ */
+void epochExit();
+
+/*
+ * Free p with fn once no reader can still see it.
+ * PRE: p is no longer reachable by new readers.
+ */
+void epochRetire(void* p, void (*fn)(void*));
+
+#endif
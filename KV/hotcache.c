@@ -0,0 +1,105 @@
+/* The hot key cache: a shared count-min sketch and per-thread replicas. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "hotcache.h"
+
+#define SKETCH_ROWS 4
+#define SKETCH_COLS 1024
+#define SAMPLE 8              /* one in SAMPLE misses is counted */
+#define HOT_THRESHOLD 16      /* sampled reads that make a key hot */
+#define DECAY 8192            /* samples between halving the counts */
+#define NSTAMPS 4096
+
+struct replica {
+    char* key;
+    unsigned hash;
+    unsigned long stamp;
+    Value* value;             /* private copy, the replica holds one ref */
+};
+
+unsigned sketch[SKETCH_ROWS][SKETCH_COLS];
+unsigned long nSamples = 0;
+
+/* bumped on every write, 8 to a cache line, so they stay read-mostly */
+unsigned long stamps[NSTAMPS];
+
+__thread struct replica replicas[HOT_SLOTS];
+__thread unsigned sampleTick = 0;
+
+const unsigned seeds[SKETCH_ROWS] = {0x9e3779b1u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu};
+
+unsigned sketchCol(unsigned hash, int row) {
+    return ((hash ^ (hash >> 15)) * seeds[row]) >> 22;
+}
+
+unsigned long hotStamp(unsigned hash) {
+    return __atomic_load_n(&stamps[hash % NSTAMPS], __ATOMIC_ACQUIRE);
+}
+
+void hotInvalidate(unsigned hash) {
+    __atomic_add_fetch(&stamps[hash % NSTAMPS], 1, __ATOMIC_RELEASE);
+}
+
+void dropReplica(struct replica* r) {
+    free(r->key);
+    releaseValue(r->value);
+    r->key = NULL;
+    r->value = NULL;
+}
+
+Value* hotLookup(const char* key, unsigned hash) {
+    struct replica* r = &replicas[(hash / NSTAMPS) % HOT_SLOTS];
+    if (r->key == NULL || r->hash != hash || strcmp(r->key, key)) {
+        return NULL;
+    }
+    if (hotStamp(hash) != r->stamp) {
+        dropReplica(r);
+        return NULL;
+    }
+    __atomic_add_fetch(&r->value->refs, 1, __ATOMIC_RELAXED);
+    return r->value;
+}
+
+/* Halve every count so keys that cooled down stop counting as hot. */
+void decay() {
+    for (int i = 0; i < SKETCH_ROWS; i++) {
+        for (int j = 0; j < SKETCH_COLS; j++) {
+            unsigned c = __atomic_load_n(&sketch[i][j], __ATOMIC_RELAXED);
+            __atomic_store_n(&sketch[i][j], c / 2, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void hotOffer(const char* key, unsigned hash, Value* v, unsigned long stamp) {
+    unsigned estimate = ~0u;
+    if (++sampleTick % SAMPLE != 0) { return; }
+    for (int i = 0; i < SKETCH_ROWS; i++) {
+        unsigned c = __atomic_add_fetch(&sketch[i][sketchCol(hash, i)], 1, __ATOMIC_RELAXED);
+        if (c < estimate) { estimate = c; }
+    }
+    if (__atomic_add_fetch(&nSamples, 1, __ATOMIC_RELAXED) % DECAY == 0) { decay(); }
+    if (estimate < HOT_THRESHOLD || v->len > HOT_MAX_VALUE) { return; }
+    // copy the value so reading the replica never touches the shared one
+    char* key_copy = strdup(key);
+    char* data = malloc(v->len + 1);
+    Value* copy = malloc(sizeof(Value));
+    if (key_copy == NULL || data == NULL || copy == NULL) {
+        free(key_copy);
+        free(data);
+        free(copy);
+        return;
+    }
+    memcpy(data, v->data, v->len + 1);
+    copy->data = data;
+    copy->len = v->len;
+    copy->rawlen = 0;
+    copy->refs = 1;
+    copy->free_it = 1;
+    struct replica* r = &replicas[(hash / NSTAMPS) % HOT_SLOTS];
+    if (r->key != NULL) { dropReplica(r); }
+    r->key = key_copy;
+    r->hash = hash;
+    r->stamp = stamp;
+    r->value = copy;
+}
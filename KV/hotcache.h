@@ -0,0 +1,42 @@
+/* Header file for the hot key cache.
+ * A count-min sketch, sampled on GETs that miss the cache, finds the
+ * keys most GETs ask for. Each thread keeps private copies of those
+ * values, so reading them touches no memory shared with other cores
+ * except a stamp that only changes when the key is written.
+ * The store calls hotInvalidate whenever it changes or deletes a key.
+ */
+
+#ifndef _hotcache_h_
+#define _hotcache_h_
+
+#include "kv.h"
+
+#define HOT_SLOTS 64          /* replicas per thread */
+#define HOT_MAX_VALUE 4096    /* larger values are not replicated */
+
+/*
+ * The invalidation stamp of a key hash, read before the value
+ * that is then offered with hotOffer.
+ */
+unsigned long hotStamp(unsigned hash);
+
+/*
+ * Look for a replica of key in the calling thread.
+ * RETURNS: the replica pinned, to be passed to releaseValue,
+ * NULL if there is none or the key was written since it was made.
+ */
+Value* hotLookup(const char* key, unsigned hash);
+
+/*
+ * Count a read of key in the sketch and, if the key is hot,
+ * copy the pinned value v into a replica of the calling thread.
+ * PRE: stamp was read with hotStamp before v was read.
+ */
+void hotOffer(const char* key, unsigned hash, Value* v, unsigned long stamp);
+
+/*
+ * Invalidate the replicas of a key, after its value was replaced.
+ */
+void hotInvalidate(unsigned hash);
+
+#endif
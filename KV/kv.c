@@ -1,88 +1,662 @@
 /* The kv store implementation.
- * Neither thread-safe nor optimized.
+ * Keys are hashed into NSHARDS shards, each a chained hash table
+ * with its own lock, so operations on different shards don't contend.
+ * With placement on, shard n's table lives on NUMA node n % nodes.
+ * Writers take the shard lock. Readers take no lock: each item has a
+ * seqlock word that is odd while its value is being replaced, and
+ * memory readers may still see is freed through epoch.c.
+ * A transaction holds a sorted set of shard locks, the shards'
+ * txn words send readers to the lock until it is done.
+ * Values of COMPRESS_MIN bytes or more are kept compressed with the
+ * codec in lz.c when that saves an eighth or more, and handed to
+ * readers decompressed.
  */
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
 #include "kv.h"
+#include "epoch.h"
+#include "hotcache.h"
+#include "lz.h"
+#include "numa.h"
 
-#define NITEMS 100
+#define NITEMS 65536
+#define NSHARDS 16
+#define NBUCKETS 256
+#define COMPRESS_MIN 128
 
 struct item {
     char* key;
-    char* value;
+    Value* value;
+    unsigned long long seq;    /* seqlock word, the version is seq / 2 */
+    unsigned hash;
+    struct item* next;
 };
 
-struct item items[NITEMS];
+/* page aligned so each shard's table can be placed on its own node */
+struct shard {
+    pthread_mutex_t lock;
+    unsigned txn;              /* odd while a transaction holds the shard */
+    struct item* buckets[NBUCKETS];
+} __attribute__((aligned(4096)));
+
+struct shard shards[NSHARDS];
 int nItems = 0;
 
-/* Of course a hashtable would be much more efficient. */
+/* what the compressed values take, before and after compression */
+long nCompressed = 0;
+long rawBytes = 0;
+long storedBytes = 0;
+
+/* told about every change, for replication */
+void (*changeHook)(const char* key, const char* data) = NULL;
+
+/* the shards locked by this thread's transaction, bit per shard */
+__thread unsigned heldShards = 0;
 
-/* Check if an item exists. If so, return the item, else NULL. */
-struct item* findItem(const char* key) {
-    for (int i = 0; i < nItems; i++) {
-        if (!strcmp(items[i].key, key)) { return &items[i]; }
+pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+void initShards() {
+    for (int i = 0; i < NSHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+/* FNV-1a, the low bits pick the shard and the rest the bucket. */
+unsigned hashKey(const char* key) {
+    unsigned h = 2166136261u;
+    for (; *key; key++) {
+        h = (h ^ (unsigned char) *key) * 16777619u;
+    }
+    return h;
+}
+
+/* Lock the shard holding key and return it. */
+struct shard* lockShard(const char* key, unsigned* hash) {
+    pthread_once(&shards_once, initShards);
+    *hash = hashKey(key);
+    struct shard* sh = &shards[*hash % NSHARDS];
+    /* inside a transaction the shard is already ours */
+    if (!(heldShards & (1u << (*hash % NSHARDS)))) {
+        pthread_mutex_lock(&sh->lock);
+    }
+    return sh;
+}
+
+void unlockShard(struct shard* sh) {
+    if (!(heldShards & (1u << (sh - shards)))) {
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+/* Lock the shards of the keys in shard order, so batches can't deadlock. */
+void lockKeys(char** keys, int n) {
+    unsigned mask = 0;
+    pthread_once(&shards_once, initShards);
+    for (int i = 0; i < n; i++) {
+        if (keys[i] != NULL) { mask |= 1u << (hashKey(keys[i]) % NSHARDS); }
+    }
+    for (int i = 0; i < NSHARDS; i++) {
+        if (mask & (1u << i)) {
+            pthread_mutex_lock(&shards[i].lock);
+            __atomic_store_n(&shards[i].txn, shards[i].txn + 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    heldShards = mask;
+}
+
+void unlockKeys() {
+    for (int i = NSHARDS - 1; i >= 0; i--) {
+        if (heldShards & (1u << i)) {
+            __atomic_store_n(&shards[i].txn, shards[i].txn + 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&shards[i].lock);
+        }
+    }
+    heldShards = 0;
+}
+
+/* Wrap a heap string in a value holding the store's reference. */
+Value* newValue(char* data, int free_it) {
+    Value* v = malloc(sizeof(Value));
+    if (v == NULL) { return NULL; }
+    v->data = data;
+    v->len = strlen(data);
+    v->rawlen = 0;
+    v->refs = 1;
+    v->free_it = free_it;
+    return v;
+}
+
+void freeValue(void* p) {
+    Value* v = p;
+    if (v->rawlen > 0) {
+        __atomic_sub_fetch(&nCompressed, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&rawBytes, v->rawlen, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&storedBytes, v->len, __ATOMIC_RELAXED);
+    }
+    if (v->free_it) { free(v->data); }
+    free(v);
+}
+
+/*
+ * Compress a new value if that pays off. The data then moves to a
+ * buffer the store owns, and the caller frees the original data
+ * once the value is stored (see dropValue for when it isn't).
+ */
+Value* packValue(Value* v) {
+    if (v == NULL || v->len < COMPRESS_MIN) { return v; }
+    char* buf = malloc(v->len);
+    size_t n = buf != NULL ? lzCompress(v->data, v->len, buf, v->len - v->len / 8) : 0;
+    if (n == 0) {
+        free(buf);
+        return v;
+    }
+    char* shrunk = realloc(buf, n);
+    v->data = shrunk != NULL ? shrunk : buf;
+    v->rawlen = v->len;
+    v->len = n;
+    v->free_it = 1;
+    __atomic_add_fetch(&nCompressed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&rawBytes, v->rawlen, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&storedBytes, v->len, __ATOMIC_RELAXED);
+    return v;
+}
+
+/* Free a new value that didn't get stored, the caller keeps its data. */
+void dropValue(Value* v) {
+    if (v != NULL && v->rawlen > 0) {
+        freeValue(v);
+    } else {
+        free(v);
+    }
+}
+
+/* The data of a compressed value in a new heap string, NULL if out of memory. */
+char* plainData(Value* v) {
+    char* data = malloc(v->rawlen + 1);
+    if (data == NULL) { return NULL; }
+    if (lzDecompress(v->data, v->len, data, v->rawlen) != v->rawlen) {
+        free(data);
+        return NULL;
+    }
+    data[v->rawlen] = '\0';
+    return data;
+}
+
+/* Drop one reference, freeing the value with the last one. */
+void putValue(Value* v) {
+    if (__atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        /* a lock-free reader may be about to try pinning it */
+        epochRetire(v, freeValue);
+    }
+}
+
+/* Take a reference unless the value is already on its way out. */
+int tryPin(Value* v) {
+    int refs = __atomic_load_n(&v->refs, __ATOMIC_RELAXED);
+    while (refs > 0) {
+        if (__atomic_compare_exchange_n(&v->refs, &refs, refs + 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void freeItem(void* p) {
+    struct item* i = p;
+    free(i->key);
+    free(i);
+}
+
+/* Swap a pinned compressed value for a decompressed copy of it. */
+Value* unpackValue(Value* v) {
+    if (v == NULL || v->rawlen == 0) { return v; }
+    char* data = plainData(v);
+    Value* raw = data != NULL ? malloc(sizeof(Value)) : NULL;
+    if (raw != NULL) {
+        raw->data = data;
+        raw->len = v->rawlen;
+        raw->rawlen = 0;
+        raw->refs = 1;
+        raw->free_it = 1;
+    } else {
+        free(data);
+    }
+    putValue(v);
+    return raw;
+}
+
+/* Report a change to a locked key to the hook, v is NULL for a delete. */
+void logChange(const char* key, Value* v) {
+    void (*fn)(const char*, const char*) = __atomic_load_n(&changeHook, __ATOMIC_ACQUIRE);
+    if (fn == NULL) { return; }
+    if (v == NULL || v->rawlen == 0) {
+        fn(key, v != NULL ? v->data : NULL);
+        return;
+    }
+    char* plain = plainData(v);
+    if (plain != NULL) {
+        fn(key, plain);
+        free(plain);
+    }
+}
+
+/* Find an item in a locked shard, else NULL. */
+struct item* findItem(struct shard* sh, unsigned hash, const char* key) {
+    struct item* i = sh->buckets[(hash / NSHARDS) % NBUCKETS];
+    for (; i != NULL; i = i->next) {
+        if (!strcmp(i->key, key)) { return i; }
     }
     return NULL;
 }
 
+/* Add an item to a locked shard, NULL if out of memory or slots. */
+struct item* addItem(struct shard* sh, unsigned hash, const char* key, Value* v) {
+    if (__atomic_add_fetch(&nItems, 1, __ATOMIC_RELAXED) > NITEMS) {
+        __atomic_sub_fetch(&nItems, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct item* i = malloc(sizeof(struct item));
+    char* copy = malloc(strlen(key) + 1);
+    if (i == NULL || copy == NULL) {
+        __atomic_sub_fetch(&nItems, 1, __ATOMIC_RELAXED);
+        free(i);
+        free(copy);
+        return NULL;
+    }
+    strncpy(copy, key, strlen(key) + 1);
+    struct item** bucket = &sh->buckets[(hash / NSHARDS) % NBUCKETS];
+    i->key = copy;
+    i->value = v;
+    i->seq = 2;
+    i->hash = hash;
+    i->next = *bucket;
+    /* publish the item only once it is complete */
+    __atomic_store_n(bucket, i, __ATOMIC_RELEASE);
+    logChange(key, v);
+    return i;
+}
+
+/* Swap in a new value, the old one is dropped by the caller. */
+Value* replaceValue(struct item* i, Value* v) {
+    Value* old = i->value;
+    /* an odd seq tells readers the value is changing */
+    __atomic_store_n(&i->seq, i->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&i->value, v, __ATOMIC_RELAXED);
+    __atomic_store_n(&i->seq, i->seq + 1, __ATOMIC_RELEASE);
+    hotInvalidate(i->hash);
+    logChange(i->key, v);
+    return old;
+}
+
+/* Read the value and version of an item under the shard lock. */
+Value* lockedRead(const char* key, unsigned long long* version) {
+    unsigned hash;
+    Value* v = NULL;
+    struct shard* sh = lockShard(key, &hash);
+    struct item* i = findItem(sh, hash, key);
+    if (i != NULL) {
+        v = i->value;
+        __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+        *version = i->seq / 2;
+    }
+    unlockShard(sh);
+    return v;
+}
+
+/*
+ * Read the value and version of an item without the shard lock.
+ * The value is pinned, and the seqlock guarantees it is the value
+ * that belongs to the returned version.
+ */
+Value* readItem(const char* key, unsigned long long* version) {
+    unsigned hash = hashKey(key);
+    struct shard* sh = &shards[hash % NSHARDS];
+    struct item* i;
+    Value* v = NULL;
+    unsigned long long seq;
+    unsigned txn = __atomic_load_n(&sh->txn, __ATOMIC_ACQUIRE);
+    /* wait for a transaction on the shard to finish, or
+       read under the lock if there are too many threads to track */
+    if ((txn & 1) || epochEnter() < 0) {
+        return lockedRead(key, version);
+    }
+    i = __atomic_load_n(&sh->buckets[(hash / NSHARDS) % NBUCKETS], __ATOMIC_ACQUIRE);
+    for (; i != NULL; i = __atomic_load_n(&i->next, __ATOMIC_ACQUIRE)) {
+        if (!strcmp(i->key, key)) { break; }
+    }
+    while (i != NULL) {
+        seq = __atomic_load_n(&i->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) { continue; }
+        v = __atomic_load_n(&i->value, __ATOMIC_RELAXED);
+        int pinned = tryPin(v);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&i->seq, __ATOMIC_RELAXED) == seq) {
+            /* unchanged but unpinnable means the item was deleted */
+            if (pinned) { *version = seq / 2; } else { v = NULL; }
+            break;
+        }
+        if (pinned) { putValue(v); }
+        v = NULL;
+    }
+    epochExit();
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&sh->txn, __ATOMIC_RELAXED) != txn) {
+        /* a transaction started meanwhile, read its outcome instead */
+        if (v != NULL) { putValue(v); }
+        return lockedRead(key, version);
+    }
+    return v;
+}
+
 /* API version of find. */
 char* findValue(const char* key) {
-    struct item *i = findItem(key);
-    if (i != NULL) {
-        return i->value;
-    } else {
-        return NULL;
+    unsigned hash;
+    char* value = NULL;
+    struct shard* sh = lockShard(key, &hash);
+    struct item *i = findItem(sh, hash, key);
+    if (i != NULL && i->value->rawlen == 0) { value = i->value->data; }
+    unlockShard(sh);
+    return value;
+}
+
+/*
+ * Pinned version of find, NULL if the key does not exist.
+ * Hot keys are served from the calling thread's replica, unless
+ * a transaction is writing to their shard.
+ */
+Value* acquireValue(const char* key) {
+    unsigned long long version;
+    Value* v;
+    if (key == NULL) { return NULL; }
+    unsigned hash = hashKey(key);
+    struct shard* sh = &shards[hash % NSHARDS];
+    unsigned txn = __atomic_load_n(&sh->txn, __ATOMIC_ACQUIRE);
+    unsigned long stamp = hotStamp(hash);
+    if (!(txn & 1)) {
+        v = hotLookup(key, hash);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (v != NULL && __atomic_load_n(&sh->txn, __ATOMIC_RELAXED) == txn) {
+            return v;
+        }
+        if (v != NULL) { putValue(v); }
     }
+    v = unpackValue(readItem(key, &version));
+    if (v != NULL) { hotOffer(key, hash, v, stamp); }
+    return v;
+}
+
+Value* acquireVersion(const char* key, unsigned long long* version) {
+    if (key == NULL) { return NULL; }
+    return unpackValue(readItem(key, version));
+}
+
+void releaseValue(Value* v) {
+    if (v != NULL) { putValue(v); }
 }
 
 /* 1 = exists, 0 = does not exist. */
 int itemExists(const char* key) {
-    return (findItem(key) != NULL);
+    unsigned hash;
+    if (key == NULL) { return 0; }
+    struct shard* sh = lockShard(key, &hash);
+    int exists = (findItem(sh, hash, key) != NULL);
+    unlockShard(sh);
+    return exists;
 }
 
 /* 0 = success, -1 = failed (item exists or table full) */
 int createItem(const char* key, char* value) {
+    unsigned hash;
     if (key == NULL)      { return -1; }
     if (value == NULL)    { return -1; }
-    if (nItems == NITEMS - 1) { return -1; }
-    if (itemExists(key))  { return -1; }
-    char* copy = malloc(strlen(key) + 1);
-    if (copy == NULL) { return -1; }
-    strncpy(copy, key, strlen(key) + 1);
-    items[nItems].key = copy;
-    items[nItems].value = value;
-    nItems++;
+    Value* v = packValue(newValue(value, 0));
+    if (v == NULL) { return -1; }
+    struct shard* sh = lockShard(key, &hash);
+    if (findItem(sh, hash, key) != NULL || addItem(sh, hash, key, v) == NULL) {
+        unlockShard(sh);
+        dropValue(v);
+        return -1;
+    }
+    unlockShard(sh);
+    if (v->rawlen > 0) { free(value); }
     return 0;
 }
 
 /* 0 = success, -1 = failed (does not exist) */
-int updateItem(const char* key, char* newValue) {
-    if (key == NULL || newValue == NULL) { return -1; }
-    struct item *i = findItem(key);
-    if (i == NULL) { return -1; }
-    i->value = newValue;
+int updateItem(const char* key, char* newData) {
+    unsigned hash;
+    if (key == NULL || newData == NULL) { return -1; }
+    Value* v = packValue(newValue(newData, 0));
+    if (v == NULL) { return -1; }
+    struct shard* sh = lockShard(key, &hash);
+    struct item *i = findItem(sh, hash, key);
+    if (i == NULL) {
+        unlockShard(sh);
+        dropValue(v);
+        return -1;
+    }
+    Value* old = replaceValue(i, v);
+    unlockShard(sh);
+    if (v->rawlen > 0) { free(newData); }
+    /* the old data is left alone unless the store made it */
+    putValue(old);
     return 0;
 }
 
 /* 0 = success, -1 = error (does not exist) */
 int deleteItem(const char* key, int free_it) {
+    unsigned hash;
     if (key == NULL) { return -1; }
-    struct item *i = findItem(key);
-    if (i == NULL) { return -1; }
-    if (free_it) { free(i->value); }
-    
-    struct item *last = items + nItems - 1;
-    if (i == last) {
-        nItems--;
-        return 0;
-    } else {
-        memcpy(i, last, sizeof(struct item));
-        nItems--;
-        return 0;
+    struct shard* sh = lockShard(key, &hash);
+    struct item** p = &sh->buckets[(hash / NSHARDS) % NBUCKETS];
+    while (*p != NULL && strcmp((*p)->key, key)) {
+        p = &(*p)->next;
     }
+    struct item* i = *p;
+    if (i == NULL) {
+        unlockShard(sh);
+        return -1;
+    }
+    __atomic_store_n(p, i->next, __ATOMIC_RELEASE);
+    hotInvalidate(hash);
+    logChange(i->key, NULL);
+    unlockShard(sh);
+    __atomic_sub_fetch(&nItems, 1, __ATOMIC_RELAXED);
+    /* readers still sending the value keep it alive */
+    Value* v = i->value;
+    if (free_it) { v->free_it = 1; }
+    putValue(v);
+    /* a lock-free reader may still be walking past the item */
+    epochRetire(i, freeItem);
+    return 0;
 }
 
 int countItems() {
-    return nItems;
+    return __atomic_load_n(&nItems, __ATOMIC_RELAXED);
+}
+
+/* 0 = success, -1 = not an integer, overflow or out of memory */
+int incrItem(const char* key, long long delta, long long* result) {
+    unsigned hash;
+    long long n = 0;
+    char* end;
+    char* data = malloc(24);
+    if (key == NULL || data == NULL) {
+        free(data);
+        return -1;
+    }
+    struct shard* sh = lockShard(key, &hash);
+    struct item* i = findItem(sh, hash, key);
+    if (i != NULL) {
+        char* plain = i->value->rawlen > 0 ? plainData(i->value) : i->value->data;
+        errno = 0;
+        n = plain != NULL ? strtoll(plain, &end, 10) : 0;
+        int bad = plain == NULL || errno || end == plain || *end != '\0';
+        if (plain != i->value->data) { free(plain); }
+        if (bad) {
+            unlockShard(sh);
+            free(data);
+            return -1;
+        }
+    }
+    if (__builtin_add_overflow(n, delta, &n)) {
+        unlockShard(sh);
+        free(data);
+        return -1;
+    }
+    sprintf(data, "%lld", n);
+    Value* v = newValue(data, 1);
+    Value* old = NULL;
+    if (v == NULL || (i == NULL && addItem(sh, hash, key, v) == NULL)) {
+        unlockShard(sh);
+        free(data);
+        free(v);
+        return -1;
+    }
+    if (i != NULL) { old = replaceValue(i, v); }
+    unlockShard(sh);
+    if (old != NULL) {
+        old->free_it = 1;
+        putValue(old);
+    }
+    *result = n;
+    return 0;
+}
+
+/* new length on success, -1 = out of memory */
+long appendItem(const char* key, const char* text) {
+    unsigned hash;
+    if (key == NULL || text == NULL) { return -1; }
+    struct shard* sh = lockShard(key, &hash);
+    struct item* i = findItem(sh, hash, key);
+    Value* cur = i != NULL ? i->value : NULL;
+    size_t oldLen = cur == NULL ? 0 : cur->rawlen > 0 ? cur->rawlen : cur->len;
+    size_t len = oldLen + strlen(text);
+    char* data = malloc(len + 1);
+    if (data != NULL && cur != NULL && cur->rawlen > 0) {
+        if (lzDecompress(cur->data, cur->len, data, oldLen) != oldLen) {
+            free(data);
+            data = NULL;
+        }
+    } else if (data != NULL && cur != NULL) {
+        memcpy(data, cur->data, oldLen);
+    }
+    if (data != NULL) { strncpy(data + oldLen, text, len - oldLen + 1); }
+    Value* v = data != NULL ? packValue(newValue(data, 1)) : NULL;
+    if (v == NULL) {
+        unlockShard(sh);
+        free(data);
+        return -1;
+    }
+    Value* old = NULL;
+    if (i != NULL) {
+        old = replaceValue(i, v);
+    } else if (addItem(sh, hash, key, v) == NULL) {
+        unlockShard(sh);
+        dropValue(v);
+        free(data);
+        return -1;
+    }
+    unlockShard(sh);
+    if (v->rawlen > 0) { free(data); }
+    if (old != NULL) {
+        old->free_it = 1;
+        putValue(old);
+    }
+    return len;
+}
+
+/* 0 = swapped, -1 = no such key or out of memory, 1 = version mismatch */
+int casItem(const char* key, unsigned long long version, char* value,
+            unsigned long long* current) {
+    unsigned hash;
+    if (key == NULL || value == NULL) { return -1; }
+    Value* v = packValue(newValue(value, 1));
+    if (v == NULL) { return -1; }
+    struct shard* sh = lockShard(key, &hash);
+    struct item* i = findItem(sh, hash, key);
+    if (i == NULL || i->seq / 2 != version) {
+        *current = i != NULL ? i->seq / 2 : 0;
+        unlockShard(sh);
+        dropValue(v);
+        return i == NULL ? -1 : 1;
+    }
+    Value* old = replaceValue(i, v);
+    *current = i->seq / 2;
+    unlockShard(sh);
+    if (v->rawlen > 0) { free(value); }
+    old->free_it = 1;
+    putValue(old);
+    return 0;
+}
+
+/* the old value pinned, NULL if the key was created (or out of memory) */
+Value* getsetItem(const char* key, char* value, int* err) {
+    unsigned hash;
+    *err = -1;
+    if (key == NULL || value == NULL) { return NULL; }
+    Value* v = packValue(newValue(value, 1));
+    if (v == NULL) { return NULL; }
+    struct shard* sh = lockShard(key, &hash);
+    struct item* i = findItem(sh, hash, key);
+    if (i == NULL) {
+        if (addItem(sh, hash, key, v) == NULL) {
+            unlockShard(sh);
+            dropValue(v);
+            return NULL;
+        }
+        unlockShard(sh);
+        if (v->rawlen > 0) { free(value); }
+        *err = 0;
+        return NULL;
+    }
+    /* the store's reference passes to the caller */
+    Value* old = replaceValue(i, v);
+    unlockShard(sh);
+    if (v->rawlen > 0) { free(value); }
+    old->free_it = 1;
+    *err = 0;
+    return unpackValue(old);
+}
+
+void compressionStats(long* values, long* raw, long* stored) {
+    *values = __atomic_load_n(&nCompressed, __ATOMIC_RELAXED);
+    *raw = __atomic_load_n(&rawBytes, __ATOMIC_RELAXED);
+    *stored = __atomic_load_n(&storedBytes, __ATOMIC_RELAXED);
+}
+
+void setChangeHook(void (*fn)(const char* key, const char* data)) {
+    __atomic_store_n(&changeHook, fn, __ATOMIC_RELEASE);
+}
+
+int placeShards() {
+    int failed = 0;
+    pthread_once(&shards_once, initShards);
+    for (int n = 0; n < NSHARDS; n++) {
+        if (bindNode(&shards[n], sizeof(struct shard), n % numaNodes()) < 0) { failed = -1; }
+    }
+    return failed;
+}
+
+void forEachItem(void (*fn)(const char* key, const char* data, void* arg), void* arg) {
+    pthread_once(&shards_once, initShards);
+    for (int n = 0; n < NSHARDS; n++) {
+        struct shard* sh = &shards[n];
+        pthread_mutex_lock(&sh->lock);
+        for (int b = 0; b < NBUCKETS; b++) {
+            for (struct item* i = sh->buckets[b]; i != NULL; i = i->next) {
+                char* plain = i->value->rawlen > 0 ? plainData(i->value) : i->value->data;
+                if (plain != NULL) { fn(i->key, plain, arg); }
+                if (plain != i->value->data) { free(plain); }
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
 }
@@ -1,19 +1,64 @@
 /* Header file for kv store. 
  * You may use all the methods in this file.
- * Note: the implementation is not thread-safe.
+ * Note: every call that changes the store takes the lock of the key's
+ * shard, acquireValue and acquireVersion read without it. A pointer
+ * returned by findValue is only safe while nobody deletes the item.
+ * Use acquireValue/releaseValue to read a value concurrently.
  */
 
 #ifndef _kv_h_
 #define _kv_h_
 
+#include <stddef.h>
+
+/*
+ * A value pinned by acquireValue.
+ * data and len stay valid until the matching releaseValue,
+ * even if the item is updated or deleted in the meantime.
+ * The store may keep large values compressed, but the values it
+ * hands out are always plain NUL terminated strings.
+ */
+typedef struct value {
+    char* data;
+    size_t len;
+    size_t rawlen; /* size once decompressed, 0 if data is not compressed */
+    int refs;     /* one for the store plus one per pinned reader */
+    int free_it;  /* free data once the last reference is dropped */
+} Value;
+
 /*
  * Search for the value stored under key.
  * PRE: key is not null.
  * RETURNS: If the key exists, a pointer to the value stored under this key.
- * If the key does not exist, it returns NULL.
+ * If the key does not exist, or the value is kept compressed, it returns NULL.
  */
 char* findValue(const char* key);
 
+/*
+ * Pin the value stored under key so it can be read without holding
+ * the store lock, e.g. while it is written to a socket.
+ * PRE: key is not null.
+ * RETURNS: If the key exists, the pinned value, which must be
+ * passed to releaseValue when done. If the key does not exist, NULL.
+ */
+Value* acquireValue(const char* key);
+
+/*
+ * Like acquireValue, and also return the version of the item the
+ * value belongs to, for use with casItem.
+ * PRE: key is not null.
+ * POST: if the key exists, *version holds the item's version.
+ * RETURNS: the pinned value or NULL, as acquireValue.
+ */
+Value* acquireVersion(const char* key, unsigned long long* version);
+
+/*
+ * Drop a reference taken by acquireValue.
+ * POST: if this was the last reference to a value that was deleted
+ * with free_it set, the value is freed.
+ */
+void releaseValue(Value* v);
+
 /*
  * Test if a key exists.
  * PRE: key is not null (if it is, this function returns 0).
@@ -25,7 +70,8 @@ int itemExists(const char* key);
  * Create a new item under the given key.
  * The store makes a copy of the key, so it is fine to pass a pointer to a key
  * which lives on the stack. The value however is not copied - it must be
- * allocated on the heap.
+ * allocated on the heap. A large value may be stored compressed instead,
+ * in which case the store frees it once the call succeeds.
  * PRE: Neither key nor value may be NULL and
  * an item with the given key must not exist yet.
  * POST: if successful, the pair (key, value) is added to the store.
@@ -40,7 +86,7 @@ int createItem(const char* key, char* value);
 /*
  * Update a new item under the given key.
  * The old value is not freed - if you want to do this,
- * use delete followed by create.
+ * use delete followed by create. Values are taken as by createItem.
  * PRE: Neither key nor value may be NULL. Key must exist in the store.
  * POST: On success, the pair (key, value) is stored.
  * RETURNS: 0 for success, (-1) on error.
@@ -66,4 +112,100 @@ int deleteItem(const char* key, int free_it);
  */
 int countItems();
 
+/*
+ * The atomic operations below read and replace a value under the
+ * shard lock in one step. The values they replace are freed once
+ * no reader has them pinned, whoever allocated them, so only use
+ * them on values allocated for the store.
+ * Every change to an item increments its version, starting from 1.
+ */
+
+/*
+ * Add delta to the 64-bit integer stored under key.
+ * A missing key counts as 0 and is created.
+ * POST: on success the new number is stored and put in *result.
+ * RETURNS: 0 for success, (-1) on error.
+ * ERRORS: - The value is not a decimal integer.
+ *         - The result overflows.
+ *         - Out of memory.
+ */
+int incrItem(const char* key, long long delta, long long* result);
+
+/*
+ * Append text to the value stored under key, creating it if missing.
+ * The text is copied.
+ * RETURNS: the new length of the value, (-1) on error.
+ * ERRORS: - Key or text is NULL.
+ *         - Out of memory.
+ */
+long appendItem(const char* key, const char* text);
+
+/*
+ * Store value under key only if the item is at the given version.
+ * The value must be allocated on the heap, the store owns it once stored.
+ * POST: *current holds the item's version after the call, 0 if missing.
+ * RETURNS: 0 if the value was stored, 1 on a version mismatch
+ * and (-1) on error.
+ * ERRORS: - Key does not exist.
+ *         - Out of memory.
+ */
+int casItem(const char* key, unsigned long long version, char* value,
+            unsigned long long* current);
+
+/*
+ * Store value under key and return the value it replaces.
+ * The value must be allocated on the heap, the store owns it once stored.
+ * RETURNS: the old value, pinned, to be passed to releaseValue.
+ * NULL if the key was created or on error, *err tells them
+ * apart: 0 for success, (-1) for out of memory.
+ */
+Value* getsetItem(const char* key, char* value, int* err);
+
+/*
+ * Start a transaction: lock the shards holding the n keys, NULL keys
+ * are skipped. Until unlockKeys the calling thread may use the other
+ * functions on these keys and they all happen as one step, other
+ * threads wait for the shards. Shards are locked in a fixed order so
+ * concurrent transactions can't deadlock.
+ * PRE: the thread holds no transaction already.
+ * Writing other keys before unlockKeys may deadlock.
+ */
+void lockKeys(char** keys, int n);
+
+/*
+ * End the transaction started with lockKeys.
+ */
+void unlockKeys();
+
+/*
+ * Report the memory held by compressed values, including replaced
+ * ones still pinned or waiting to be freed: how many there are and
+ * how many bytes they hold before and after compression.
+ */
+void compressionStats(long* values, long* raw, long* stored);
+
+/*
+ * Have fn called with every change to the store, with the key still
+ * locked so the calls for a key come in the order of its changes.
+ * data is the new value, NULL when the key was deleted.
+ * PRE: fn must not call back into the store.
+ */
+void setChangeHook(void (*fn)(const char* key, const char* data));
+
+/*
+ * Move the table of each shard to its home node, n % numaNodes().
+ * Items are allocated by the thread writing them, so with pinned
+ * workers they land on the writer's node.
+ * PRE: numaInit was called.
+ * RETURNS: 0 on success, (-1) if a shard could not be moved.
+ */
+int placeShards();
+
+/*
+ * Call fn with every key and value in the store, one shard at a
+ * time with the shard locked.
+ * PRE: fn must not call back into the store.
+ */
+void forEachItem(void (*fn)(const char* key, const char* data, void* arg), void* arg);
+
 #endif
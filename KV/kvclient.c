@@ -0,0 +1,484 @@
+/* The kv client library: consistent hashing, pooling and pipelining. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "kvclient.h"
+
+#define HELLO_REPLY "HELLO 2\n"
+#define VALUE_REPLY "VALUE "
+
+struct conn {
+    int fd;
+    size_t len, cap;           /* reply bytes read so far */
+    char* buf;
+};
+
+struct server {
+    char addr[64];
+    struct sockaddr_in sa;
+    int nopen;                 /* connections made, idle or in use */
+    int nidle;
+    struct conn* idle[POOL_SIZE];
+};
+
+struct point {
+    unsigned hash;
+    int server;
+};
+
+struct kvcluster {
+    pthread_mutex_t lock;      /* the ring and the pools */
+    pthread_cond_t freed;      /* a connection went back to a pool or was closed */
+    int nservers;
+    struct server servers[MAX_SERVERS];
+    int npoints;
+    struct point points[MAX_SERVERS * VNODES];
+};
+
+/* The commands of one call that go to one server. */
+struct batch {
+    int server;
+    struct conn* conn;
+    int first, count;          /* their range in the call's order */
+    int sent, done;
+};
+
+/* FNV-1a with a final mix, so nearby names land far apart. */
+unsigned hashString(const char* s) {
+    unsigned h = 2166136261u;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char) *s) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+int comparePoints(const void* a, const void* b) {
+    unsigned x = ((const struct point*) a)->hash, y = ((const struct point*) b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* The server owning key, under the cluster lock. */
+int serverOf(KVCluster* c, const char* key) {
+    unsigned h = hashString(key);
+    int lo = 0, hi = c->npoints;
+    // the first point at or after the key's hash, wrapping around
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (c->points[mid].hash < h) { lo = mid + 1; } else { hi = mid; }
+    }
+    return c->points[lo == c->npoints ? 0 : lo].server;
+}
+
+int kvAddServer(KVCluster* c, const char* addr) {
+    char host[64], name[96];
+    const char* colon = strrchr(addr, ':');
+    if (colon == NULL || colon - addr >= (long) sizeof(host)) { return -1; }
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+    pthread_mutex_lock(&c->lock);
+    if (c->nservers == MAX_SERVERS) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    struct server* s = &c->servers[c->nservers];
+    memset(s, 0, sizeof(*s));
+    s->sa.sin_family = AF_INET;
+    s->sa.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &s->sa.sin_addr) != 1) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    snprintf(s->addr, sizeof(s->addr), "%s", addr);
+    for (int i = 0; i < VNODES; i++) {
+        snprintf(name, sizeof(name), "%s#%d", addr, i);
+        c->points[c->npoints].hash = hashString(name);
+        c->points[c->npoints].server = c->nservers;
+        c->npoints++;
+    }
+    qsort(c->points, c->npoints, sizeof(struct point), comparePoints);
+    c->nservers++;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+KVCluster* kvConnect(const char** addrs, int n) {
+    KVCluster* c = malloc(sizeof(KVCluster));
+    if (c == NULL) { return NULL; }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->freed, NULL);
+    c->nservers = 0;
+    c->npoints = 0;
+    for (int i = 0; i < n; i++) {
+        if (kvAddServer(c, addrs[i]) < 0) {
+            kvClose(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+void closeConn(struct conn* k) {
+    close(k->fd);
+    free(k->buf);
+    free(k);
+}
+
+void kvClose(KVCluster* c) {
+    for (int i = 0; i < c->nservers; i++) {
+        for (int j = 0; j < c->servers[i].nidle; j++) {
+            closeConn(c->servers[i].idle[j]);
+        }
+    }
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->freed);
+    free(c);
+}
+
+const char* kvServerOf(KVCluster* c, const char* key) {
+    pthread_mutex_lock(&c->lock);
+    const char* addr = c->nservers > 0 ? c->servers[serverOf(c, key)].addr : NULL;
+    pthread_mutex_unlock(&c->lock);
+    return addr;
+}
+
+/*
+ * Take the next reply line off a connection's buffer.
+ * RETURNS: the reply as a heap string without its end of line,
+ * NULL if it isn't all in yet.
+ */
+char* takeReply(struct conn* k) {
+    char* end = memchr(k->buf, '\n', k->len);
+    if (end == NULL) { return NULL; }
+    size_t n = end - k->buf;
+    char* reply = malloc(n + 1);
+    if (reply == NULL) { return NULL; }
+    memcpy(reply, k->buf, n);
+    reply[n] = '\0';
+    n++;
+    memmove(k->buf, k->buf + n, k->len - n);
+    k->len -= n;
+    return reply;
+}
+
+/* Read what the server sent, -1 if the connection failed. */
+int readConn(struct conn* k) {
+    if (k->len == k->cap) {
+        char* buf = realloc(k->buf, 2 * k->cap);
+        if (buf == NULL) { return -1; }
+        k->buf = buf;
+        k->cap *= 2;
+    }
+    ssize_t n = read(k->fd, k->buf + k->len, k->cap - k->len);
+    if (n <= 0) { return -1; }
+    k->len += n;
+    return 0;
+}
+
+int sendAll(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+        if (sent < 0) { return -1; }
+        p += sent;
+        n -= sent;
+    }
+    return 0;
+}
+
+/*
+ * Connect to a server and switch it to the non-interactive protocol.
+ * The banner and prompt the server greets every connection with are
+ * skipped, along with anything else before the HELLO reply.
+ */
+struct conn* openConn(struct server* s) {
+    struct conn* k = malloc(sizeof(struct conn));
+    if (k == NULL) { return NULL; }
+    k->len = 0;
+    k->cap = 4096;
+    k->buf = malloc(k->cap);
+    k->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (k->buf == NULL || k->fd < 0 ||
+        connect(k->fd, (struct sockaddr*) &s->sa, sizeof(s->sa)) < 0) {
+        if (k->fd >= 0) { close(k->fd); }
+        free(k->buf);
+        free(k);
+        return NULL;
+    }
+    if (sendAll(k->fd, "HELLO\n", 6) < 0) {
+        closeConn(k);
+        return NULL;
+    }
+    char* end;
+    while ((end = memmem(k->buf, k->len, HELLO_REPLY, strlen(HELLO_REPLY))) == NULL) {
+        if (readConn(k) < 0) {
+            closeConn(k);
+            return NULL;
+        }
+    }
+    size_t n = end - k->buf + strlen(HELLO_REPLY);
+    memmove(k->buf, k->buf + n, k->len - n);
+    k->len -= n;
+    return k;
+}
+
+/* Close a connection taken with checkout, or give up on one not made (k NULL). */
+void dropConn(KVCluster* c, int server, struct conn* k) {
+    if (k != NULL) { closeConn(k); }
+    pthread_mutex_lock(&c->lock);
+    c->servers[server].nopen--;
+    pthread_cond_broadcast(&c->freed);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Take an idle connection to a server, or make a new one, waiting
+ * while POOL_SIZE are already in use.
+ */
+struct conn* checkout(KVCluster* c, int server) {
+    struct conn* k = NULL;
+    pthread_mutex_lock(&c->lock);
+    struct server* s = &c->servers[server];
+    while (s->nidle == 0 && s->nopen == POOL_SIZE) {
+        pthread_cond_wait(&c->freed, &c->lock);
+    }
+    if (s->nidle > 0) {
+        k = s->idle[--s->nidle];
+    } else {
+        s->nopen++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (k == NULL && (k = openConn(s)) == NULL) {
+        dropConn(c, server, NULL);
+    }
+    return k;
+}
+
+/* Return a connection to the pool. */
+void checkin(KVCluster* c, int server, struct conn* k) {
+    pthread_mutex_lock(&c->lock);
+    struct server* s = &c->servers[server];
+    s->idle[s->nidle++] = k;
+    pthread_cond_broadcast(&c->freed);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Give up on a server's commands, their replies stay NULL. */
+void failBatch(KVCluster* c, struct batch* b, int* left) {
+    *left -= b->count - b->done;
+    b->done = b->count;
+    dropConn(c, b->server, b->conn);
+    b->conn = NULL;
+}
+
+/* Send the batch's next commands, up to PIPELINE in flight. */
+int sendBatch(struct batch* b, char** lines, int* order) {
+    size_t len = 0;
+    int last = b->sent;
+    while (last < b->count && last - b->done < PIPELINE) {
+        len += strlen(lines[order[b->first + last]]);
+        last++;
+    }
+    char* out = malloc(len + 1);
+    if (out == NULL) { return -1; }
+    len = 0;
+    for (int i = b->sent; i < last; i++) {
+        const char* line = lines[order[b->first + i]];
+        memcpy(out + len, line, strlen(line));
+        len += strlen(line);
+    }
+    int err = sendAll(b->conn->fd, out, len);
+    free(out);
+    b->sent = last;
+    return err;
+}
+
+/*
+ * Run n command lines, each on the server owning keys[i], and put
+ * the replies in replies (NULL for a failed server). The commands
+ * for each server are pipelined on one connection and all servers
+ * are served at once from one poll loop.
+ * RETURNS: 0 if every server answered, else (-1).
+ */
+int runBatch(KVCluster* c, const char** keys, char** lines, int n, char** replies) {
+    int nb = 0, err = 0, left = 0;
+    int* order = malloc(n * sizeof(int));
+    struct batch* b = malloc(MAX_SERVERS * sizeof(struct batch));
+    struct pollfd* fds = malloc(MAX_SERVERS * sizeof(struct pollfd));
+    int* srv = malloc(n * sizeof(int));
+    if (order == NULL || b == NULL || fds == NULL || srv == NULL) {
+        free(order); free(b); free(fds); free(srv);
+        return -1;
+    }
+    // group the commands by server
+    int count[MAX_SERVERS] = {0};
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < n; i++) {
+        replies[i] = NULL;
+        srv[i] = c->nservers > 0 ? serverOf(c, keys[i]) : -1;
+        if (srv[i] >= 0) { count[srv[i]]++; }
+    }
+    pthread_mutex_unlock(&c->lock);
+    for (int s = 0, first = 0; s < MAX_SERVERS; s++) {
+        if (count[s] == 0) { continue; }
+        b[nb].server = s;
+        b[nb].first = first;
+        b[nb].count = 0;
+        b[nb].sent = b[nb].done = 0;
+        b[nb].conn = NULL;
+        first += count[s];
+        count[s] = nb++;
+    }
+    for (int i = 0; i < n; i++) {
+        if (srv[i] < 0) {
+            err = -1;
+            continue;
+        }
+        struct batch* bt = &b[count[srv[i]]];
+        order[bt->first + bt->count++] = i;
+    }
+    // in server order, so calls waiting for connections can't deadlock
+    for (int i = 0; i < nb; i++) {
+        b[i].conn = checkout(c, b[i].server);
+        if (b[i].conn == NULL) {
+            err = -1;
+            b[i].done = b[i].count;
+        }
+        left += b[i].count - b[i].done;
+    }
+    while (left > 0) {
+        int nfds = 0;
+        for (int i = 0; i < nb; i++) {
+            if (b[i].done == b[i].count) {
+                fds[i].fd = -1;
+                continue;
+            }
+            // top the pipeline up once half of it has been answered
+            if (b[i].sent - b[i].done <= PIPELINE / 2 && b[i].sent < b[i].count &&
+                sendBatch(&b[i], lines, order) < 0) {
+                failBatch(c, &b[i], &left);
+                err = -1;
+                fds[i].fd = -1;
+                continue;
+            }
+            fds[i].fd = b[i].conn->fd;
+            fds[i].events = POLLIN;
+            nfds++;
+        }
+        if (nfds == 0 || poll(fds, nb, -1) < 0) { break; }
+        for (int i = 0; i < nb; i++) {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) { continue; }
+            if (readConn(b[i].conn) < 0) {
+                failBatch(c, &b[i], &left);
+                err = -1;
+                continue;
+            }
+            char* reply;
+            while (b[i].done < b[i].sent && (reply = takeReply(b[i].conn)) != NULL) {
+                replies[order[b[i].first + b[i].done++]] = reply;
+                left--;
+            }
+        }
+    }
+    for (int i = 0; i < nb; i++) {
+        if (b[i].conn != NULL) { checkin(c, b[i].server, b[i].conn); }
+    }
+    free(order); free(b); free(fds); free(srv);
+    return err;
+}
+
+/* Build a command line, NULL if the arguments can't be sent. */
+char* makeLine(const char* cmd, const char* key, const char* value) {
+    if (strpbrk(key, " \r\n") != NULL || *key == '\0') { return NULL; }
+    if (value != NULL && strpbrk(value, "\r\n") != NULL) { return NULL; }
+    size_t n = strlen(cmd) + strlen(key) + (value != NULL ? strlen(value) : 0) + 4;
+    char* line = malloc(n);
+    if (line == NULL) { return NULL; }
+    if (value != NULL) {
+        snprintf(line, n, "%s %s %s\n", cmd, key, value);
+    } else {
+        snprintf(line, n, "%s %s\n", cmd, key);
+    }
+    return line;
+}
+
+/* Run one command per key, replies as runBatch. */
+int runEach(KVCluster* c, const char* cmd, const char** keys, const char** values,
+            int n, char** replies) {
+    char** lines = malloc(n * sizeof(char*));
+    int err = 0;
+    if (lines == NULL) { return -1; }
+    for (int i = 0; i < n; i++) {
+        lines[i] = makeLine(cmd, keys[i], values != NULL ? values[i] : NULL);
+        if (lines[i] == NULL) { err = -1; }
+    }
+    if (err == 0) {
+        err = runBatch(c, keys, lines, n, replies);
+    } else {
+        for (int i = 0; i < n; i++) { replies[i] = NULL; }
+    }
+    for (int i = 0; i < n; i++) { free(lines[i]); }
+    free(lines);
+    return err;
+}
+
+int kvMultiGet(KVCluster* c, const char** keys, int n, char** values) {
+    int found = 0;
+    int err = runEach(c, "GET", keys, NULL, n, values);
+    // a found value comes framed, anything else is a miss or an error
+    for (int i = 0; i < n; i++) {
+        if (values[i] == NULL) { continue; }
+        if (strncmp(values[i], VALUE_REPLY, strlen(VALUE_REPLY))) {
+            free(values[i]);
+            values[i] = NULL;
+            continue;
+        }
+        memmove(values[i], values[i] + strlen(VALUE_REPLY), strlen(values[i]) - strlen(VALUE_REPLY) + 1);
+        found++;
+    }
+    return err < 0 ? -1 : found;
+}
+
+int kvMultiPut(KVCluster* c, const char** keys, const char** values, int n) {
+    char** replies = malloc(n * sizeof(char*));
+    if (replies == NULL) { return -1; }
+    int err = runEach(c, "PUT", keys, values, n, replies);
+    for (int i = 0; i < n; i++) {
+        if (replies[i] == NULL || (strcmp(replies[i], "Item succesfully created") &&
+                                   strcmp(replies[i], "Key sucsessfully updated"))) {
+            err = -1;
+        }
+        free(replies[i]);
+    }
+    free(replies);
+    return err;
+}
+
+char* kvGet(KVCluster* c, const char* key) {
+    char* value;
+    kvMultiGet(c, &key, 1, &value);
+    return value;
+}
+
+int kvPut(KVCluster* c, const char* key, const char* value) {
+    return kvMultiPut(c, &key, &value, 1);
+}
+
+int kvDelete(KVCluster* c, const char* key) {
+    char* reply;
+    int err = runEach(c, "DELETE", &key, NULL, 1, &reply);
+    if (reply == NULL || strcmp(reply, "Delete successful")) { err = -1; }
+    free(reply);
+    return err;
+}
@@ -0,0 +1,81 @@
+/* Header file for the kv client library.
+ * A cluster spreads keys over several KV servers with a consistent
+ * hash ring: each server owns VNODES points on the ring and a key
+ * belongs to the first point after its hash, so adding a server
+ * only moves the keys of the points it takes over, about 1/N.
+ * Connections use the non-interactive protocol (HELLO) and are
+ * pooled per server, at most POOL_SIZE to each so a host stays
+ * within the server's per-client limit, and the multi-key calls
+ * pipeline their commands to all the servers involved at once.
+ * An idle pooled connection holds no server worker, the threads
+ * engine parks it until its next command.
+ * A cluster may be shared by several threads.
+ */
+
+#ifndef _kvclient_h_
+#define _kvclient_h_
+
+#define VNODES 100
+#define MAX_SERVERS 64
+#define POOL_SIZE 4       /* connections open per server at most, the server's default perclient limit */
+#define PIPELINE 32       /* commands in flight per connection */
+
+typedef struct kvcluster KVCluster;
+
+/*
+ * Create a cluster of the servers at addrs, each given as host:port
+ * of its data port. Connections are made when first needed.
+ * RETURNS: the cluster, NULL if an address is invalid or on error.
+ */
+KVCluster* kvConnect(const char** addrs, int n);
+
+/*
+ * Close all connections and free the cluster.
+ */
+void kvClose(KVCluster* c);
+
+/*
+ * Add a server to the ring, the keys it now owns are not moved.
+ * RETURNS: 0 on success, (-1) if the address is invalid or the
+ * cluster has MAX_SERVERS servers.
+ */
+int kvAddServer(KVCluster* c, const char* addr);
+
+/*
+ * RETURNS: the address of the server owning key.
+ */
+const char* kvServerOf(KVCluster* c, const char* key);
+
+/*
+ * Get the value stored under key.
+ * RETURNS: a heap copy of the value for the caller to free,
+ * NULL if the key does not exist or the server can't be reached.
+ */
+char* kvGet(KVCluster* c, const char* key);
+
+/*
+ * Store value under key, creating or replacing it.
+ * RETURNS: 0 on success, (-1) on error.
+ */
+int kvPut(KVCluster* c, const char* key, const char* value);
+
+/*
+ * Delete key.
+ * RETURNS: 0 on success, (-1) if it did not exist or on error.
+ */
+int kvDelete(KVCluster* c, const char* key);
+
+/*
+ * Get n keys at once, values[i] is set as by kvGet for keys[i].
+ * RETURNS: the number of keys found, (-1) if a server failed
+ * (the values got so far are still set).
+ */
+int kvMultiGet(KVCluster* c, const char** keys, int n, char** values);
+
+/*
+ * Store n key/value pairs at once.
+ * RETURNS: 0 if all were stored, else (-1).
+ */
+int kvMultiPut(KVCluster* c, const char** keys, const char** values, int n);
+
+#endif
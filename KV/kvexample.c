@@ -0,0 +1,68 @@
+/*
+ * An example of the kv client library, and a quick check of it
+ * against running servers: it stores a few keys over the cluster,
+ * reads them back one by one and all at once, and deletes them.
+ * use: ./kvexample host:port [host:port ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvclient.h"
+
+#define NKEYS 20
+
+int failed = 0;
+
+void check(int ok, const char* what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failed = 1;
+    }
+}
+
+int main(int argc, char** argv) {
+    char keys[NKEYS][16], values[NKEYS][32];
+    const char* k[NKEYS + 1];
+    const char* v[NKEYS];
+    char* got[NKEYS + 1];
+    if (argc < 2) {
+        printf("Usage: %s host:port [host:port ...]\n", argv[0]);
+        exit(1);
+    }
+    KVCluster* c = kvConnect((const char**) argv + 1, argc - 1);
+    if (c == NULL) {
+        printf("Invalid server address\n");
+        exit(1);
+    }
+    for (int i = 0; i < NKEYS; i++) {
+        sprintf(keys[i], "example%d", i);
+        sprintf(values[i], "value %d", i);
+        k[i] = keys[i];
+        v[i] = values[i];
+    }
+    // a value that reads like the server's reply for a missing key
+    v[0] = "No such item.";
+    check(kvMultiPut(c, k, v, NKEYS) == 0, "kvMultiPut");
+    for (int i = 0; i < NKEYS; i++) {
+        char* value = kvGet(c, k[i]);
+        check(value != NULL && !strcmp(value, v[i]), "kvGet");
+        free(value);
+    }
+    // all the keys and one that doesn't exist, across all servers at once
+    k[NKEYS] = "example-missing";
+    check(kvMultiGet(c, k, NKEYS + 1, got) == NKEYS, "kvMultiGet count");
+    for (int i = 0; i < NKEYS; i++) {
+        check(got[i] != NULL && !strcmp(got[i], v[i]), "kvMultiGet value");
+        free(got[i]);
+    }
+    check(got[NKEYS] == NULL, "kvMultiGet missing key");
+    printf("%s lives on %s\n", k[0], kvServerOf(c, k[0]));
+    for (int i = 0; i < NKEYS; i++) {
+        check(kvDelete(c, k[i]) == 0, "kvDelete");
+    }
+    check(kvGet(c, k[0]) == NULL, "kvGet after kvDelete");
+    kvClose(c);
+    printf(failed ? "kvexample failed\n" : "kvexample passed\n");
+    return failed;
+}
@@ -0,0 +1,114 @@
+/* The LZ codec. */
+
+#include <string.h>
+#include <stdint.h>
+#include "lz.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Write a length that didn't fit its nibble as a run of 255s and the rest. */
+int putLength(unsigned char* out, size_t* op, size_t cap, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (*op >= cap) { return -1; }
+        out[(*op)++] = 255;
+    }
+    if (*op >= cap) { return -1; }
+    out[(*op)++] = len;
+    return 0;
+}
+
+/* Emit one sequence, a match length of 0 marks the last one. */
+int putSequence(unsigned char* out, size_t* op, size_t cap,
+                const unsigned char* lit, size_t nlit, size_t offset, size_t mlen) {
+    size_t m = mlen > 0 ? mlen - MIN_MATCH : 0;
+    if (*op >= cap) { return -1; }
+    out[(*op)++] = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15 && putLength(out, op, cap, nlit - 15) < 0) { return -1; }
+    if (*op + nlit > cap) { return -1; }
+    memcpy(out + *op, lit, nlit);
+    *op += nlit;
+    if (mlen == 0) { return 0; }
+    if (*op + 2 > cap) { return -1; }
+    out[(*op)++] = offset & 0xff;
+    out[(*op)++] = offset >> 8;
+    if (m >= 15 && putLength(out, op, cap, m - 15) < 0) { return -1; }
+    return 0;
+}
+
+size_t lzCompress(const char* src, size_t n, char* dst, size_t cap) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    /* positions + 1 of the last 4-byte sequences seen, 0 for none */
+    size_t table[1 << HASH_BITS];
+    size_t ip = 0, op = 0, anchor = 0;
+    memset(table, 0, sizeof(table));
+    while (ip + MIN_MATCH <= n) {
+        uint32_t seq = read32(in + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        size_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(in + ref - 1) != seq) {
+            ip++;
+            continue;
+        }
+        ref--;
+        size_t len = MIN_MATCH;
+        while (ip + len < n && in[ref + len] == in[ip + len]) { len++; }
+        if (putSequence(out, &op, cap, in + anchor, ip - anchor, ip - ref, len) < 0) {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+    if (putSequence(out, &op, cap, in + anchor, n - anchor, 0, 0) < 0) {
+        return 0;
+    }
+    return op;
+}
+
+/* Read a length extension, -1 if the input runs out. */
+int getLength(const unsigned char* in, size_t* ip, size_t n, size_t* len) {
+    unsigned char b;
+    do {
+        if (*ip >= n) { return -1; }
+        b = in[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+size_t lzDecompress(const char* src, size_t n, char* dst, size_t cap) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        unsigned char token = in[ip++];
+        size_t nlit = token >> 4;
+        if (nlit == 15 && getLength(in, &ip, n, &nlit) < 0) { return 0; }
+        if (ip + nlit > n || op + nlit > cap) { return 0; }
+        memcpy(out + op, in + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) { break; }   /* the last sequence has no match */
+        if (ip + 2 > n) { return 0; }
+        size_t offset = in[ip] | in[ip + 1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && getLength(in, &ip, n, &mlen) < 0) { return 0; }
+        mlen += MIN_MATCH;
+        if (offset == 0 || offset > op || op + mlen > cap) { return 0; }
+        /* byte by byte, a match may overlap the bytes it produces */
+        for (size_t i = 0; i < mlen; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+    return op;
+}
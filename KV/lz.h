@@ -0,0 +1,26 @@
+/* Header file for the LZ codec.
+ * A small LZ77 codec in the style of the LZ4 block format: each
+ * sequence is a token byte (literal and match length nibbles), the
+ * literals, and for all but the last sequence a 2-byte offset back
+ * into the output. It is fast enough to run on every store and read.
+ */
+
+#ifndef _lz_h_
+#define _lz_h_
+
+#include <stddef.h>
+
+/*
+ * Compress n bytes of src into dst, which holds cap bytes.
+ * RETURNS: the compressed size, 0 if it would not fit in cap.
+ */
+size_t lzCompress(const char* src, size_t n, char* dst, size_t cap);
+
+/*
+ * Decompress n bytes of src into dst, which holds cap bytes.
+ * RETURNS: the decompressed size, 0 if src is corrupt or
+ * the result would not fit in cap.
+ */
+size_t lzDecompress(const char* src, size_t n, char* dst, size_t cap);
+
+#endif
@@ -0,0 +1,129 @@
+/* CPU and NUMA placement: node layout from sysfs, pinning and mbind. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "numa.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#define MPOL_PREFERRED 1
+#define MPOL_MF_MOVE (1 << 1)
+/* node ids mbind can be asked for */
+#define MAX_NODE_ID 1024
+
+int nNodes = 1;
+int cpuNode[MAX_CPUS];
+/* the kernel's id of each node, ids may have gaps */
+int nodeId[MAX_NODES];
+
+/* the cpus of each node, in the order workers are placed on them */
+int nodeCpus[MAX_NODES][MAX_CPUS];
+int nCpus[MAX_NODES];
+
+/*
+ * Read a sysfs list such as "0-3,8-11" into out, up to max numbers
+ * below limit.
+ * RETURNS: how many were read.
+ */
+int readList(const char* list, int* out, int max, int limit) {
+    const char* p = list;
+    int n = 0;
+    while (*p >= '0' && *p <= '9') {
+        char* end;
+        int first = strtol(p, &end, 10), last = first;
+        if (*end == '-') { last = strtol(end + 1, &end, 10); }
+        for (int i = first; i <= last && i < limit && n < max; i++) {
+            out[n++] = i;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+/* Read the first line of a sysfs file into line, returns 0 if there is one. */
+int readLine(const char* path, char* line, int size) {
+    FILE* f = fopen(path, "r");
+    int ok;
+    if (f == NULL) { return -1; }
+    ok = fgets(line, size, f) != NULL;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+int numaInit() {
+    char path[64], list[4096];
+    int ids[MAX_NODES], found;
+    nNodes = 0;
+    /* the online nodes by id, which need not be contiguous */
+    found = readLine("/sys/devices/system/node/online", list, sizeof(list)) == 0
+            ? readList(list, ids, MAX_NODES, 1 << 20) : 0;
+    for (int i = 0; i < found; i++) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", ids[i]);
+        if (readLine(path, list, sizeof(list)) != 0) { continue; }
+        nodeId[nNodes] = ids[i];
+        nCpus[nNodes] = readList(list, nodeCpus[nNodes], MAX_CPUS, MAX_CPUS);
+        for (int c = 0; c < nCpus[nNodes]; c++) { cpuNode[nodeCpus[nNodes][c]] = nNodes; }
+        nNodes++;
+    }
+    if (nNodes > 0) { return nNodes; }
+    /* no NUMA information, every cpu we may run on is node 0 */
+    cpu_set_t set;
+    nNodes = 1;
+    nodeId[0] = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE && c < MAX_CPUS; c++) {
+            if (CPU_ISSET(c, &set)) { nodeCpus[0][nCpus[0]++] = c; }
+        }
+    }
+    return nNodes;
+}
+
+int numaNodes() {
+    return nNodes;
+}
+
+int numaNodeOf(int cpu) {
+    if (cpu < 0 || cpu >= MAX_CPUS) { return 0; }
+    return cpuNode[cpu];
+}
+
+int workerCpu(int i) {
+    int node = i % nNodes;
+    if (nCpus[node] == 0) { return -1; }
+    return nodeCpus[node][(i / nNodes) % nCpus[node]];
+}
+
+int pinThread(int cpu) {
+    cpu_set_t set;
+    if (cpu < 0) { return -1; }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int bindNode(void* addr, unsigned long len, int node) {
+    unsigned long mask[MAX_NODE_ID / (8 * sizeof(unsigned long))];
+    int id = nodeId[node];
+    /* nothing to gain on a single node, and the call may be filtered */
+    if (nNodes < 2 || id >= MAX_NODE_ID) { return 0; }
+    memset(mask, 0, sizeof(mask));
+    mask[id / (8 * sizeof(unsigned long))] = 1ul << (id % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, MAX_NODE_ID, MPOL_MF_MOVE) == 0 ? 0 : -1;
+}
+
+int incomingCpu(int fd) {
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) { return -1; }
+    return cpu;
+}
@@ -0,0 +1,59 @@
+/* Header file for CPU and NUMA placement.
+ * The node layout is read from sysfs, so no libnuma is needed. With
+ * placement on, each worker is pinned to a core, spread round robin
+ * over the nodes, shards are homed on node shard % nodes and accepted
+ * connections are handed to a worker on the node whose core received
+ * them. A machine without NUMA is treated as a single node.
+ * Nodes are numbered 0 to numaNodes() - 1 here, whatever ids the
+ * kernel gives them.
+ */
+
+#ifndef _numa_h_
+#define _numa_h_
+
+#define MAX_NODES 8
+#define MAX_CPUS 1024
+
+/*
+ * Read the node of every online CPU.
+ * RETURNS: the number of nodes, 1 when sysfs has no NUMA information.
+ */
+int numaInit();
+
+/*
+ * RETURNS: the number of nodes found by numaInit.
+ */
+int numaNodes();
+
+/*
+ * RETURNS: the node of cpu, 0 if it is unknown.
+ */
+int numaNodeOf(int cpu);
+
+/*
+ * The core for worker number i, consecutive workers go to
+ * different nodes so every node gets its share.
+ * RETURNS: the cpu, (-1) if no CPU is known.
+ */
+int workerCpu(int i);
+
+/*
+ * Pin the calling thread to cpu.
+ * RETURNS: 0 on success, (-1) on failure.
+ */
+int pinThread(int cpu);
+
+/*
+ * Ask for the pages covering [addr, addr + len) to live on node,
+ * moving the ones already touched. addr must be page aligned.
+ * RETURNS: 0 on success, (-1) on failure.
+ */
+int bindNode(void* addr, unsigned long len, int node);
+
+/*
+ * RETURNS: the cpu that received the packets of socket fd, (-1) if
+ * the kernel doesn't tell.
+ */
+int incomingCpu(int fd);
+
+#endif
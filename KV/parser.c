@@ -3,23 +3,41 @@
 #include "parser.h"
 
 /*
- * Parse a data command. Legal commands:
+ * Parse a data command, buf holds one NUL terminated line. Legal commands:
  * PUT key text
  * GET key
  * COUNT
  * DELETE key
  * EXISTS key
+ * INCR key [delta]
+ * DECR key [delta]
+ * APPEND key text
+ * GETSET key text
+ * CAS key version text (the version is the start of text)
+ * GETV key
+ * MULTI
+ * EXEC
+ * DISCARD
+ * HELLO
  */
 int parse_d(char* buf, enum DATA_CMD *cmd, char **key, char **text) {
-    const char* commands[] = {"PUT", "GET", "COUNT", "DELETE", "EXISTS", NULL};
-    const int args[] =       {2,     1,     0,       1,        1,        -1  }; 
+    const char* commands[] = {"PUT", "GET", "COUNT", "DELETE", "EXISTS",
+                              "INCR", "DECR", "APPEND", "GETSET", "CAS", "GETV",
+                              "MULTI", "EXEC", "DISCARD", "HELLO", NULL};
+    const int args[] =       {2,     1,     0,       1,        1,
+                              2,      2,      2,        2,        2,     1,
+                              0,       0,      0,         0,       -1  };
+    /* commands whose text is optional */
+    const int optText[] =    {0,     0,     0,       0,        0,
+                              1,      1,      0,        0,        0,     0,
+                              0,       0,      0,         0,       0   };
 
     *key = NULL;
     *text = NULL;
 
     /* Find the first word. */
     char *s;
-    char *end = buf + LINE - 1;
+    char *end = buf + strlen(buf) + 1;
 
     int nWords = 0;
     for (s = buf; s < end; s++) {
@@ -90,7 +108,7 @@ int parse_d(char* buf, enum DATA_CMD *cmd, char **key, char **text) {
         }
     }
 
-    if (nWords == 2 && nArgs == 1) {
+    if (nWords == 2 && (nArgs == 1 || optText[*cmd])) {
         *text = NULL;
         return 0;
     }
@@ -128,6 +146,10 @@ enum CONTROL_CMD parse_c(char* buffer) {
         return C_SHUTDOWN;
     } else if (!strcmp(buffer, "COUNT")) {
         return C_COUNT;
+    } else if (!strcmp(buffer, "STATS")) {
+        return C_STATS;
+    } else if (!strcmp(buffer, "REPLICATE")) {
+        return C_REPLICATE;
     } else {
         return C_ERROR;
     }
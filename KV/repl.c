@@ -0,0 +1,296 @@
+/* Asynchronous primary/replica replication. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "kv.h"
+#include "repl.h"
+
+#define SEND_CHUNK 65536
+#define CHECK_SECS 1    /* how often an idle sender checks its replica is still there */
+
+/* the mutation log, a ring of the last LOG_SIZE bytes of changes */
+char ring[LOG_SIZE];
+unsigned long long head = 0;          /* bytes ever logged */
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+int replica = 0;
+int primary_fd = -1;
+
+int isReplica(){
+    return replica;
+}
+
+/* Add n bytes to the log, under log_lock. */
+void logBytes(const char *p, size_t n){
+    size_t at = head % LOG_SIZE;
+    size_t first = n < LOG_SIZE - at ? n : LOG_SIZE - at;
+    memcpy(ring + at, p, first);
+    memcpy(ring, p + first, n - first);
+    head += n;
+}
+
+/*
+* This function is the store's change hook
+* it logs a change as the line a replica applies
+*/
+void logMutation(const char *key, const char *data){
+    size_t klen = strlen(key), dlen = data != NULL ? strlen(data) : 0;
+    if(klen + dlen + 8 > LOG_SIZE){
+        printf("Change too large to replicate\n");
+        return;
+    }
+    pthread_mutex_lock(&log_lock);
+    if(data != NULL){
+        logBytes("PUT ", 4);
+        logBytes(key, klen);
+        logBytes(" ", 1);
+        logBytes(data, dlen);
+    }
+    else{
+        logBytes("DELETE ", 7);
+        logBytes(key, klen);
+    }
+    logBytes("\n", 1);
+    pthread_cond_broadcast(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
+
+int sendAll(int fd, const char *p, size_t n){
+    ssize_t sent;
+    while(n > 0){
+        sent = send(fd, p, n, MSG_NOSIGNAL);
+        if(sent < 0){
+            return -1;
+        }
+        p += sent;
+        n -= sent;
+    }
+    return 0;
+}
+
+struct snapshot {
+    char *buf;
+    size_t len, cap;
+};
+
+/* Add an item to the snapshot as a PUT line. */
+void snapItem(const char *key, const char *data, void *arg){
+    struct snapshot *snap = arg;
+    size_t n = strlen(key) + strlen(data) + 6;
+    if(snap->len + n > snap->cap){
+        size_t cap = 2 * snap->cap + n;
+        char *buf = realloc(snap->buf, cap);
+        if(buf == NULL){
+            printf("Error mallocing resource\n");
+            exit(1);
+        }
+        snap->buf = buf;
+        snap->cap = cap;
+    }
+    snap->len += sprintf(snap->buf + snap->len, "PUT %s %s\n", key, data);
+}
+
+/*
+* This function tells whether a replica hung up,
+* replicas send nothing after REPLICATE so any
+* readable end of stream or error means it is gone
+*/
+int replicaGone(int fd){
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/*
+* This function serves one replica: it sends the
+* snapshot, then follows the log until the replica
+* goes away or falls more than LOG_SIZE bytes behind
+*/
+void *sender(void *p){
+    int fd = (int) (long) p;
+    unsigned long long pos;
+    struct snapshot snap = {NULL, 0, 0};
+    struct timespec check;
+    char *chunk = malloc(SEND_CHUNK);
+    size_t n, at, first;
+    if(chunk == NULL){
+        printf("Error mallocing resource\n");
+        exit(1);
+    }
+    // changes made from here on are logged, so anything the
+    // snapshot misses is in the log after pos
+    pthread_mutex_lock(&log_lock);
+    setChangeHook(logMutation);
+    pos = head;
+    pthread_mutex_unlock(&log_lock);
+    forEachItem(snapItem, &snap);
+    if(sendAll(fd, snap.buf, snap.len) < 0){
+        pos = ~0ULL;
+    }
+    free(snap.buf);
+    while(pos != ~0ULL){
+        pthread_mutex_lock(&log_lock);
+        // wake up now and then while idle to notice a replica that left
+        while(head == pos){
+            clock_gettime(CLOCK_REALTIME, &check);
+            check.tv_sec += CHECK_SECS;
+            if(pthread_cond_timedwait(&log_cond, &log_lock, &check) == ETIMEDOUT && head == pos
+               && replicaGone(fd)){
+                pos = ~0ULL;
+                break;
+            }
+        }
+        if(pos == ~0ULL){
+            pthread_mutex_unlock(&log_lock);
+            break;
+        }
+        if(head - pos > LOG_SIZE){
+            pthread_mutex_unlock(&log_lock);
+            printf("Replica fell behind the log, dropping it\n");
+            break;
+        }
+        n = head - pos < SEND_CHUNK ? head - pos : SEND_CHUNK;
+        at = pos % LOG_SIZE;
+        first = n < LOG_SIZE - at ? n : LOG_SIZE - at;
+        memcpy(chunk, ring + at, first);
+        memcpy(chunk + first, ring, n - first);
+        pthread_mutex_unlock(&log_lock);
+        if(sendAll(fd, chunk, n) < 0){
+            break;
+        }
+        pos += n;
+    }
+    printf("Replica disconnected\n");
+    free(chunk);
+    close(fd);
+    return NULL;
+}
+
+void addReplica(int conn){
+    pthread_t thread;
+    // the stream is written with blocking sends from its own thread
+    if(fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) & ~O_NONBLOCK) < 0 ||
+       pthread_create(&thread, NULL, sender, (void *) (long) conn)){
+        printf("Error starting replica stream\n");
+        close(conn);
+        return;
+    }
+    pthread_detach(thread);
+    printf("Replica connected\n");
+}
+
+/* Apply one line of the primary's stream to the store. */
+void applyLine(char *line){
+    int err;
+    char *key, *data;
+    if(!strncmp(line, "PUT ", 4)){
+        key = line + 4;
+        data = strchr(key, ' ');
+        if(data == NULL){
+            return;
+        }
+        *data++ = '\0';
+        data = strdup(data);
+        if(data == NULL){
+            printf("Error mallocing resource\n");
+            exit(1);
+        }
+        // getsetItem frees the value it replaces once unpinned
+        releaseValue(getsetItem(key, data, &err));
+        if(err < 0){
+            free(data);
+            printf("Error applying change to %s\n", key);
+        }
+    }
+    else if(!strncmp(line, "DELETE ", 7)){
+        deleteItem(line + 7, 1);
+    }
+}
+
+/*
+* This function follows the primary's stream
+* and applies it line by line
+*/
+void *follower(void *p){
+    (void) p;
+    size_t len = 0, cap = 4096;
+    char *buf = malloc(cap), *eol, *start;
+    ssize_t n;
+    if(buf == NULL){
+        printf("Error mallocing resource\n");
+        exit(1);
+    }
+    while(1){
+        if(len == cap){
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if(buf == NULL){
+                printf("Error mallocing resource\n");
+                exit(1);
+            }
+        }
+        n = read(primary_fd, buf + len, cap - len);
+        if(n <= 0){
+            break;
+        }
+        len += n;
+        start = buf;
+        while((eol = memchr(start, '\n', buf + len - start)) != NULL){
+            *eol = '\0';
+            applyLine(start);
+            start = eol + 1;
+        }
+        len -= start - buf;
+        memmove(buf, start, len);
+    }
+    // keep serving what we have, there is no resync
+    printf("Lost connection to primary\n");
+    close(primary_fd);
+    free(buf);
+    return NULL;
+}
+
+void startReplica(const char *addr){
+    struct sockaddr_in sa;
+    pthread_t thread;
+    char host[64];
+    const char *colon = strrchr(addr, ':');
+    if(colon == NULL || colon - addr >= (long) sizeof(host)){
+        printf("Primary must be given as host:port\n");
+        exit(1);
+    }
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = '\0';
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(atoi(colon + 1));
+    if(inet_pton(AF_INET, host, &sa.sin_addr) != 1){
+        printf("Invalid primary address %s\n", host);
+        exit(1);
+    }
+    primary_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(primary_fd < 0 || connect(primary_fd, (struct sockaddr *) &sa, sizeof(sa)) < 0){
+        printf("Error connecting to primary %s\n", addr);
+        exit(1);
+    }
+    if(sendAll(primary_fd, "REPLICATE\n", 10) < 0){
+        printf("Error contacting primary %s\n", addr);
+        exit(1);
+    }
+    replica = 1;
+    if(pthread_create(&thread, NULL, follower, NULL)){
+        printf("Error creating replication thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+    printf("Replicating from %s\n", addr);
+}
@@ -0,0 +1,31 @@
+/* Header file for replication.
+ * A replica connects to the control port of its primary and sends
+ * REPLICATE. The primary answers with a snapshot of the store as PUT
+ * lines, then streams every change as PUT key value or DELETE key
+ * lines from an in-memory log, without waiting for the replica.
+ * Replicas only serve reads, the primary's changes are their writes.
+ */
+
+#ifndef _repl_h_
+#define _repl_h_
+
+#define LOG_SIZE (1 << 20)
+
+/*
+ * Start streaming the store to a replica on a control connection
+ * that sent REPLICATE. The connection is owned by the stream.
+ */
+void addReplica(int conn);
+
+/*
+ * Make this server a replica of the primary whose control port is
+ * at addr, given as host:port.
+ */
+void startReplica(const char *addr);
+
+/*
+ * RETURNS: 1 if this server is a replica, else 0.
+ */
+int isReplica();
+
+#endif
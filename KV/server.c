@@ -1,12 +1,24 @@
 /* Server program for key-value store. */
 /* compile with gcc *.c -std=gnu99 -o server */
 
+#define _GNU_SOURCE
+
 #include "kv.h"
 #include "parser.h"
 #include "queue.h"
+#include "session.h"
+#include "engine.h"
+#include "repl.h"
+#include "numa.h"
 
 #define NTHREADS 4
 #define BACKLOG 10
+#define MAX_CLIENTS 64
+#define MAX_CONN_PER_CLIENT 4  /* default, a kvclient pool (POOL_SIZE) fits, idle ones hold no worker */
+#define MAX_CONTROL 8
+#define CONTROL_TIMEOUT 1000
+#define DRAIN_TIMEOUT 5000
+#define DRAIN_POLL 100
 
 /* Add anything you want here. */
 #include <stdio.h>
@@ -20,13 +32,85 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
 
 int data_id[NTHREADS];
 pthread_t workers[NTHREADS];
 
-sem_t s_work_avail, s_space_avail, s_shutdown, s_data_lock, s_queue_lock;
+sem_t s_work_avail, s_space_avail, s_shutdown, s_data_lock, s_queue_lock, s_client_lock, s_drained, s_park_lock;
+
+// a queue per NUMA node, a single one unless placement is on
+Queue q[MAX_NODES];
+
+// pin workers to cores and steer connections to their node
+int placement = 0;
 
-Queue q;
+// open data connections allowed per client address, set with perclient
+int maxPerClient = MAX_CONN_PER_CLIENT;
+
+/*
+* Open data connections per client address,
+* used to enforce maxPerClient
+*/
+struct client {
+    in_addr_t addr;
+    int nconn;
+};
+
+struct client clients[MAX_CLIENTS];
+
+/*
+* A pending control client: the bytes read so far
+* and the time by which it has to complete its command
+*/
+struct control_conn {
+    int fd;
+    int len;
+    long deadline;
+    char buffer[256];
+};
+
+/*
+* A data connection of the worker threads, its session
+* lives on while the connection waits parked between commands
+*/
+struct data_conn {
+    Session session;
+    in_addr_t addr;
+};
+
+struct data_conn *data_conns[MAX_SESSIONS];
+
+/*
+* Connections a worker gave back after DRAIN_POLL ms without
+* a command, the data loop polls them and moves them to ready
+* once a command comes, workers take ready ones before new ones
+* parked is guarded by the park lock, ready by the queue lock
+*/
+int parked[MAX_SESSIONS];
+int nparked = 0;
+int ready[MAX_SESSIONS];
+int ready_front = 0;
+int nready = 0;
+
+pthread_t control_thread;
+// written by the controller to wake the data loop on shutdown
+int wake_pipe[2];
+// written by a worker to have the data loop poll a parked connection
+int park_pipe[2];
+
+/*
+* Drain state: once draining is set workers close idle
+* connections and any connection still open at drain_deadline
+* drain_time is the time the drain took, reported to the controller
+*/
+int draining = 0;
+long drain_start;
+long drain_deadline;
+long drain_time;
 
 /*
 * This function is used to initialise the semaphores
@@ -62,6 +146,21 @@ void initSemaphores(){
         printf("Error initialising semaphore\n");
         exit(1);
     }
+    err = sem_init(&s_client_lock, 0, 1);
+    if(err<0){
+        printf("Error initialising semaphore\n");
+        exit(1);
+    }
+    err = sem_init(&s_drained, 0, 0);
+    if(err<0){
+        printf("Error initialising semaphore\n");
+        exit(1);
+    }
+    err = sem_init(&s_park_lock, 0, 1);
+    if(err<0){
+        printf("Error initialising semaphore\n");
+        exit(1);
+    }
     printf("Semaphores initialised\n");
 }
 
@@ -96,16 +195,41 @@ void destroySemaphores(){
         printf("Error destroying semaphore\n"); 
         exit(1);
     }
+    err = sem_destroy(&s_client_lock);
+    if(err<0){
+        printf("Error destroying semaphore\n");
+        exit(1);
+    }
+    err = sem_destroy(&s_drained);
+    if(err<0){
+        printf("Error destroying semaphore\n");
+        exit(1);
+    }
+    err = sem_destroy(&s_park_lock);
+    if(err<0){
+        printf("Error destroying semaphore\n");
+        exit(1);
+    }
     printf("Semaphores destroyed\n");
 } 
 
+/*
+* This function returns a monotonic clock in milliseconds
+* used for the control and drain deadlines
+*/
+long now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /*
 * This function is used to initialise the sockets
 * It initialises sockets for the control and data ports
 * It also listens to for request on the socket
 */
 int initSocket(int port, struct sockaddr_in s, socklen_t len, int backlog){
-    int sockfd,err;
+    int sockfd,err,on = 1;
     len = sizeof(s);
     memset(&s, 0, len);
     sockfd = socket(AF_INET,SOCK_STREAM,0);
@@ -113,6 +237,8 @@ int initSocket(int port, struct sockaddr_in s, socklen_t len, int backlog){
         printf("Error creating socket");
         exit(1);
     }
+    // allow a restart straight after a drain
+    setsockopt(sockfd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
     s.sin_family = AF_INET;
     s.sin_addr.s_addr =  htonl(INADDR_ANY);
     s.sin_port = htons(port);
@@ -131,130 +257,321 @@ int initSocket(int port, struct sockaddr_in s, socklen_t len, int backlog){
 }
 
 /*
-* This function is used to handle incoming request
-* from the data port, parses the command
-* and sends appropriate result to client
+* This function is used to admit a client connection
+* It counts the open connections of the client address
+* and refuses the connection once maxPerClient is reached
+* or the client table is full
+* returns 0 when admitted and -1 when refused
 */
-void handle_data(int conn, char *buffer){
-    enum DATA_CMD cmd;
-    char *key, *text, *k;
-    int r=1, err, n;
-    while(r){
-        // The client can now enter a command into the terminal
-        strncpy(buffer, "\nPlease enter a command > ", LINE);
-        write(conn,buffer,LINE);
-        // read the command from the client to the buffer and add sentinal value to signal end of line
-        int l = read(conn, buffer, LINE);
-        buffer[l] = '\0';
-        // use the parse function to parse the buffer into commands, key and value
-        parse_d(buffer,&cmd,&key,&text);
-        //printf("cmd: %i, key = [%s]\n", cmd, key);
-        // now handle the requests
-        // get a value from the user and return the key if it exists
-        if (cmd == D_GET){
-            // find the value of the key using findValue
-            k = findValue(key);
-            // if the value does exist
-            if (k != NULL) {
-                strncpy(buffer,k,LINE);
-            }
-            else {
-                strncpy(buffer, "No such item.", LINE);
-            }
+int admitClient(in_addr_t addr){
+    int err, i, slot = -1, admitted = -1;
+    err = sem_wait(&s_client_lock);
+    if(err<0){
+        printf("Error waiting on semaphore\n");
+        exit(1);
+    }
+    for(i=0; i<MAX_CLIENTS; i++){
+        if(clients[i].nconn > 0 && clients[i].addr == addr){
+            slot = i;
+            break;
         }
-        // check if the client hits return to end connection 
-        else if (cmd == D_END) {
-            // Copy terminating connection message to buffer
-            // exit the loop and close connection
-            strncpy(buffer,"Goodbye\n",LINE);
-            close(conn);
-            r = 0;
-        }
-        // count the number of items in the store
-        else if(cmd == D_COUNT){
-            // get the number number of items in the store using countItems
-            // convert the number to a character
-            n = countItems();
-            char l = n + '0';
-            strncpy(buffer,&l,LINE);
-        }
-        // delete an item using its key
-        else if(cmd == D_DELETE){
-            // use the deleteItem function to delete the key and its value
-            // send the appropriate message according to its result
-            n = deleteItem(key,1);
-            if(n == 0){
-                strncpy(buffer, "Delete successful",LINE);
-            }else{
-                strncpy(buffer, "Deletion error occured",LINE);
-            }
+        if(clients[i].nconn == 0 && slot < 0){
+            slot = i;
         }
-        // check if a key exists 
-        else if(cmd == D_EXISTS){
-            n = itemExists(key);
-            if(n>0){
-                strncpy(buffer, "Item exists",LINE);
-            }
-            else{
-                strncpy(buffer, "Item doesn't exist",LINE);
-            }
+    }
+    if(slot >= 0 && clients[slot].nconn < maxPerClient){
+        clients[slot].addr = addr;
+        clients[slot].nconn++;
+        admitted = 0;
+    }
+    err = sem_post(&s_client_lock);
+    if(err<0){
+        printf("Error posting semaphore\n");
+        exit(1);
+    }
+    return admitted;
+}
+
+/*
+* This function is used to release a client connection
+* once it has been closed, freeing its slot for new connections
+*/
+void releaseClient(in_addr_t addr){
+    int err;
+    err = sem_wait(&s_client_lock);
+    if(err<0){
+        printf("Error waiting on semaphore\n");
+        exit(1);
+    }
+    for(int i=0; i<MAX_CLIENTS; i++){
+        if(clients[i].nconn > 0 && clients[i].addr == addr){
+            clients[i].nconn--;
+            break;
         }
-        // put a key and its value into the store
-        else if(cmd == D_PUT){
-            // created an allocated memory for storing values
-            char *valCopy = malloc(strlen(text)+1);
-            if(valCopy == NULL){
-                printf("Error mallocing resource\n");
-                exit(1);
-            }
-            // copy the value into the allocated memory 
-            strncpy(valCopy,text,strlen(text)+1);
-            // use the createItem function to create this item
-            n = createItem(key,valCopy);
-            // check if the item has been created from the returned value
-            if(n == 0){
-                strncpy(buffer, "Item succesfully created",LINE);
-            }
-            // check for other occurrences and errors
-            else if(n<0){
-                // if the item already exist update it
-                if(itemExists(key)>0){
-                    // use updateItem to update the value of the required key
-                    n = updateItem(key,valCopy);
-                    if(n<0){
-                        strncpy(buffer,"Error updating item",LINE);
-                    }
-                    else{
-                        strncpy(buffer,"Key sucsessfully updated",LINE);
-                    }
-                }
-                else{
-                    strncpy(buffer,"Error creating item",LINE);
-                }
+    }
+    err = sem_post(&s_client_lock);
+    if(err<0){
+        printf("Error posting semaphore\n");
+        exit(1);
+    }
+}
+
+/*
+* This function is used to turn away a connection
+* the reply is sent without blocking so a slow or
+* misbehaving client can't stall the accept loop
+*/
+void rejectConnection(int conn, const char *reason){
+    send(conn, reason, strlen(reason), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(conn);
+}
+
+/*
+* This function takes the next connection from the queues
+* a worker prefers its own node's queue and takes
+* another node's connection rather than leave it waiting
+* returns the connection, or 0 if the queues are empty
+* the caller holds the queue lock
+*/
+int popConnection(int node){
+    for(int i=0; i<numaNodes(); i++){
+        Queue *from = &q[(node + i) % numaNodes()];
+        if(!isEmpty(from)){
+            return pop(from);
+        }
+    }
+    return 0;
+}
+
+/*
+* This function takes the next parked connection that has
+* a command waiting, returns 0 if there is none
+* the caller holds the queue lock
+*/
+int popReady(){
+    int conn;
+    if(nready == 0){
+        return 0;
+    }
+    conn = ready[ready_front];
+    ready_front = (ready_front + 1) % MAX_SESSIONS;
+    nready--;
+    return conn;
+}
+
+/*
+* This function queues a parked connection for the
+* workers once its next command has arrived
+*/
+void pushReady(int conn){
+    int err;
+    err = sem_wait(&s_queue_lock);
+    if(err<0){
+        printf("Error waiting on semaphore\n");
+        exit(1);
+    }
+    ready[(ready_front + nready) % MAX_SESSIONS] = conn;
+    nready++;
+    err = sem_post(&s_work_avail);
+    if(err<0){
+        printf("Error posting semaphore\n");
+        exit(1);
+    }
+    err = sem_post(&s_queue_lock);
+    if(err<0){
+        printf("Error posting semaphore\n");
+        exit(1);
+    }
+}
+
+/*
+* This function hands an idle connection to the data
+* loop, which watches it for the next command so the
+* worker is free to serve other connections meanwhile
+*/
+void parkConnection(int conn){
+    int err;
+    err = sem_wait(&s_park_lock);
+    if(err<0){
+        printf("Error waiting on semaphore\n");
+        exit(1);
+    }
+    parked[nparked++] = conn;
+    err = sem_post(&s_park_lock);
+    if(err<0){
+        printf("Error posting semaphore\n");
+        exit(1);
+    }
+    // the pipe is non-blocking, if it is full the loop wakes anyway
+    if(write(park_pipe[1], "x", 1) < 0 && errno != EAGAIN){
+        printf("Error waking data loop\n");
+        exit(1);
+    }
+}
+
+/*
+* This function takes a connection off the parked list
+* returns 1 if it was parked
+*/
+int unparkConnection(int conn){
+    int err, found = 0;
+    err = sem_wait(&s_park_lock);
+    if(err<0){
+        printf("Error waiting on semaphore\n");
+        exit(1);
+    }
+    for(int i=0; i<nparked; i++){
+        if(parked[i] == conn){
+            parked[i] = parked[--nparked];
+            found = 1;
+            break;
+        }
+    }
+    err = sem_post(&s_park_lock);
+    if(err<0){
+        printf("Error posting semaphore\n");
+        exit(1);
+    }
+    return found;
+}
+
+/*
+* This function returns the data connection of a
+* popped connection, starting a session for a new one
+*/
+struct data_conn *openConnection(int conn){
+    struct data_conn *c = data_conns[conn];
+    struct sockaddr_in peer;
+    socklen_t peerLen;
+    if(c != NULL){
+        return c;
+    }
+    c = malloc(sizeof(struct data_conn));
+    if(c == NULL){
+        printf("Error mallocing resource\n");
+        exit(1);
+    }
+    // remember the client address to release its slot when done
+    peerLen = sizeof(peer);
+    memset(&peer, 0, peerLen);
+    getpeername(conn,(struct sockaddr*)&peer,&peerLen);
+    c->addr = peer.sin_addr.s_addr;
+    initSession(&c->session, conn);
+    data_conns[conn] = c;
+    return c;
+}
+
+/*
+* This function closes a data connection and
+* frees its session and its client slot
+*/
+void closeConnection(struct data_conn *c){
+    int conn = c->session.fd;
+    // cleared first, the descriptor may be reused once closed
+    data_conns[conn] = NULL;
+    close(conn);
+    endSession(&c->session);
+    releaseClient(c->addr);
+    free(c);
+}
+
+/*
+* This function tells a client waiting between commands
+* that the server is shutting down and closes it
+*/
+void shutConnection(int conn){
+    struct data_conn *c = data_conns[conn];
+    sessionText(&c->session, "Server shutting down\n");
+    flushSession(&c->session);
+    closeConnection(c);
+}
+
+/*
+* This function starts the drain
+* from now on workers close idle connections and
+* every connection is closed at the drain deadline
+*/
+void beginDrain(){
+    drain_start = now_ms();
+    drain_deadline = drain_start + DRAIN_TIMEOUT;
+    __atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+    printf("Draining connections.\n");
+}
+
+/*
+* This function waits for the next command on a connection
+* It waits up to DRAIN_POLL ms, an idle connection is given
+* up as soon as the server starts draining and a busy one
+* once the drain deadline has passed
+* returns 0 when a command can be read, 1 if none came
+* and the connection should be parked, and -1 to close
+*/
+int waitCommand(int conn){
+    struct pollfd pfd;
+    int n;
+    pfd.fd = conn;
+    pfd.events = POLLIN;
+    while(1){
+        n = poll(&pfd, 1, DRAIN_POLL);
+        if(n<0 && errno != EINTR){
+            return -1;
+        }
+        if(__atomic_load_n(&draining, __ATOMIC_ACQUIRE)){
+            if(n<=0 || now_ms() >= drain_deadline){
+                return -1;
             }
         }
-        // check if the line is too long
-        else if(cmd == D_ERR_OL){
-            strncpy(buffer,"Error, line is too long",LINE);
+        if(n>0){
+            return 0;
         }
-        // check if the command is invalid
-        else if(cmd == D_ERR_INVALID){
-            strncpy(buffer,"Error, invalid command: use get, put, count, exists",LINE);
+        if(n==0){
+            return 1;
         }
-        // check if the parameters exceed required
-        else if(cmd == D_ERR_LONG){
-            strncpy(buffer,"Error, too many parameters",LINE);
+    }
+}
+
+/*
+* This function is used to handle incoming request
+* from the data port, commands are read into the session
+* and executed by runCommands, which queues the results
+* that are then sent to the client
+* returns 1 when the client went quiet and the connection
+* should be parked, 0 when it should be closed
+*/
+int handle_data(Session *s){
+    int n, room, wait;
+    char *at;
+    // send what is queued, the welcome banner of a new session
+    if(flushSession(s) < 0){
+        return 0;
+    }
+    while(!s->ended){
+        // wait for the command, leave if the server is draining
+        wait = waitCommand(s->fd);
+        if(wait > 0){
+            return 1;
         }
-        // check if parameters aren't enough
-        else if(cmd == D_ERR_SHORT){
-            strncpy(buffer,"Error, too few parameters",LINE);
+        if(wait < 0){
+            sessionText(s, "Server shutting down\n");
+            flushSession(s);
+            break;
         }
-        else{
-            strncpy(buffer,"Please try again\n",LINE);
+        // read the commands from the client into the session buffer
+        at = sessionInput(s, &room);
+        n = read(s->fd, at, room);
+        // the client went away without ending the session
+        if(n <= 0){
+            break;
+        }
+        s->len += n;
+        // execute every complete command, several may arrive at once
+        while(runCommands(s) > 0){
+            if(flushSession(s) < 0){
+                return 0;
+            }
         }
-        //write reponse to user
-        write(conn, buffer, LINE);
     }
+    return 0;
 }
 
 /*
@@ -265,10 +582,15 @@ void handle_data(int conn, char *buffer){
 */
 void *worker(void *p){
     int *data = (int *) p;
-    char buffer[256];
+    struct data_conn *c;
     int err;
     printf("Worker %u starting.\n", *data);
     int shutdown;
+    // the node this worker serves, workerCpu spreads them round robin
+    int node = *data % numaNodes();
+    if(placement && pinThread(workerCpu(*data)) < 0){
+        printf("Worker %u could not be pinned\n", *data);
+    }
     while (1) {
         // at the start, worker threads wait
         // wait till work is available
@@ -291,14 +613,27 @@ void *worker(void *p){
             printf("Error waiting on semaphore\n");
             exit(1);
         }
-        /* We are now sure there really is work available. */
-        // pop the first request on the queue
-        int conn = pop(&q);
-        // once the request has been popped post that space is now available
-        err = sem_post(&s_space_avail);
-        if(err<0){
-            printf("Error posting semaphore\n");
-            exit(1);
+        // a parked connection with a command waiting goes first,
+        // otherwise pop the first request on the queues, preferring our node
+        int conn = popReady();
+        if(conn == 0){
+            conn = popConnection(node);
+            // the queue may have been emptied by a drain
+            if(conn == 0){
+                err = sem_post(&s_queue_lock);
+                if(err<0){
+                    printf("Error posting semaphore\n");
+                    exit(1);
+                }
+                continue;
+            }
+            /* We are now sure there really is work available. */
+            // once the request has been popped post that space is now available
+            err = sem_post(&s_space_avail);
+            if(err<0){
+                printf("Error posting semaphore\n");
+                exit(1);
+            }
         }
         // release lock - sempahore function
         err = sem_post(&s_queue_lock);
@@ -306,8 +641,7 @@ void *worker(void *p){
             printf("Error posting semaphore\n");
             exit(1);
         }
-        strncpy(buffer, "Welcome to the KV store.\n", LINE);
-        write(conn,buffer,LINE);
+        c = openConnection(conn);
         // now handle the commands recieved from client
         // lock the data lock
         err = sem_wait(&s_data_lock);
@@ -315,7 +649,14 @@ void *worker(void *p){
             printf("Error waiting on semaphore\n");
             exit(1);
         }
-        handle_data(conn,buffer);
+        // serve the client until it ends or goes quiet, a quiet
+        // one waits parked so it doesn't hold the worker
+        if(handle_data(&c->session)){
+            parkConnection(conn);
+        }
+        else{
+            closeConnection(c);
+        }
         err = sem_post(&s_data_lock);
         if(err<0){
             printf("Error posting semaphore\n");
@@ -330,17 +671,11 @@ void *worker(void *p){
 * This function handles incoming request 
 * from the control port, it parses the data
 * and sends appropriate response to the client
+* the reply is sent without blocking, a client that
+* isn't reading gets its reply dropped
 */
-int control_data(int conn){
-    // create a buffer to read and send data and initialize it
-    char buffer[256],letter;
+int control_data(int conn, char *buffer){
     int count;
-    bzero(buffer,256);
-    int n = read(conn,buffer,LINE);
-    if(n<0){
-        printf("Reading error\n");
-        exit(1);
-    }
     enum CONTROL_CMD cmd;
     // parse the command into the parse functon 
     // for the control port
@@ -350,26 +685,168 @@ int control_data(int conn){
         // use countItems count the number of items
         count = countItems();
         sprintf(buffer,"%d  \n",count);
-        write(conn,buffer,LINE);
+        send(conn,buffer,LINE,MSG_DONTWAIT | MSG_NOSIGNAL);
         close(conn);
         return 1;
     }
-    // check in case the command isn't recognised
-    else if(cmd == C_ERROR){
-        strncpy(buffer,"Error\n",LINE);
-        write(conn,buffer,LINE);
+    // report how well the stored values compress
+    else if(cmd == C_STATS){
+        long values, raw, stored;
+        compressionStats(&values, &raw, &stored);
+        snprintf(buffer,LINE,"Compressed values: %ld, raw bytes: %ld, stored bytes: %ld, ratio: %.2f\n",
+                 values, raw, stored, stored > 0 ? (double) raw / stored : 1.0);
+        send(conn,buffer,LINE,MSG_DONTWAIT | MSG_NOSIGNAL);
         close(conn);
         return 1;
     }
+    // a replica asks for the store and its changes,
+    // the connection now belongs to the replication stream
+    else if(cmd == C_REPLICATE){
+        addReplica(conn);
+        return 1;
+    }
     // if the command is to shutdown
+    // the connection is kept open to report the drain
     else if(cmd == C_SHUTDOWN){
         strncpy(buffer,"Shutting down\n",LINE);
-        write(conn,buffer,LINE);
-        close(conn);
+        send(conn,buffer,LINE,MSG_DONTWAIT | MSG_NOSIGNAL);
         // return zero to break out of the while loop
         // and shutdown the server
         return 0;
-    } 
+    }
+    // check in case the command isn't recognised
+    else{
+        strncpy(buffer,"Error\n",LINE);
+        send(conn,buffer,LINE,MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(conn);
+        return 1;
+    }
+}
+
+/*
+* This function is the control plane thread
+* It runs its own poll loop over the control port so
+* control commands are never queued behind data traffic.
+* Client sockets are non-blocking and each client has
+* CONTROL_TIMEOUT ms to send its command before it is dropped
+*/
+void *controller(void *p){
+    int sockfd = *(int *) p;
+    struct pollfd fds[MAX_CONTROL + 1];
+    struct control_conn conns[MAX_CONTROL];
+    int i, n, run = 1, reply = -1;
+    long now, timeout;
+    char buffer[256];
+    for(i=0; i<MAX_CONTROL; i++){
+        conns[i].fd = -1;
+    }
+    // accept must not block once the pending clients are taken
+    if(fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) < 0){
+        printf("Error setting control port non-blocking\n");
+        exit(1);
+    }
+    printf("Controller starting.\n");
+    while(run){
+        // watch the listening socket only while a slot is free
+        n = 0;
+        for(i=0; i<MAX_CONTROL; i++){
+            if(conns[i].fd < 0){
+                n++;
+            }
+        }
+        fds[MAX_CONTROL].fd = n > 0 ? sockfd : -1;
+        fds[MAX_CONTROL].events = POLLIN;
+        // wake up in time for the earliest client deadline
+        now = now_ms();
+        timeout = -1;
+        for(i=0; i<MAX_CONTROL; i++){
+            fds[i].fd = conns[i].fd;
+            fds[i].events = POLLIN;
+            if(conns[i].fd >= 0 && (timeout < 0 || conns[i].deadline - now < timeout)){
+                timeout = conns[i].deadline > now ? conns[i].deadline - now : 0;
+            }
+        }
+        n = poll(fds, MAX_CONTROL + 1, timeout);
+        if(n<0){
+            if(errno == EINTR){
+                continue;
+            }
+            printf("Error polling control port\n");
+            exit(1);
+        }
+        now = now_ms();
+        for(i=0; i<MAX_CONTROL && run; i++){
+            if(conns[i].fd < 0){
+                continue;
+            }
+            if(fds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+                n = read(conns[i].fd, conns[i].buffer + conns[i].len, LINE - conns[i].len);
+                if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+                    continue;
+                }
+                if(n <= 0){
+                    close(conns[i].fd);
+                    conns[i].fd = -1;
+                    continue;
+                }
+                conns[i].len += n;
+                conns[i].buffer[conns[i].len] = '\0';
+                // wait for the whole line unless the buffer is full
+                if(memchr(conns[i].buffer, '\n', conns[i].len) == NULL && conns[i].len < LINE){
+                    continue;
+                }
+                run = control_data(conns[i].fd, conns[i].buffer);
+                if(!run){
+                    reply = conns[i].fd;
+                }
+                conns[i].fd = -1;
+            }
+            else if(conns[i].deadline <= now){
+                printf("Control client timed out\n");
+                close(conns[i].fd);
+                conns[i].fd = -1;
+            }
+        }
+        if(run && (fds[MAX_CONTROL].revents & POLLIN)){
+            // accept as many clients as there are free slots
+            for(i=0; i<MAX_CONTROL; i++){
+                if(conns[i].fd >= 0){
+                    continue;
+                }
+                n = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK);
+                if(n<0){
+                    break;
+                }
+                printf("Client control-port Connect Server OK.\n");
+                conns[i].fd = n;
+                conns[i].len = 0;
+                conns[i].deadline = now + CONTROL_TIMEOUT;
+            }
+        }
+    }
+    // drop the remaining control clients
+    for(i=0; i<MAX_CONTROL; i++){
+        if(conns[i].fd >= 0){
+            close(conns[i].fd);
+        }
+    }
+    // wake the data loop so it can start shutting down
+    n = write(wake_pipe[1], "x", 1);
+    if(n<0){
+        printf("Error waking data loop\n");
+        exit(1);
+    }
+    // report how long the drain took to the client that asked for it
+    n = sem_wait(&s_drained);
+    if(n<0){
+        printf("Error waiting on semaphore\n");
+        exit(1);
+    }
+    sprintf(buffer,"Drained in %ld ms\n",drain_time);
+    send(reply,buffer,strlen(buffer),MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(reply);
+    printf("Controller shutting down.\n");
+    return NULL;
 }
 
 //Telnet ends with 2 EOL characters where as terminal only sends 1
@@ -378,47 +855,132 @@ int control_data(int conn){
 /* You may add code to the main() function. */
 int main(int argc, char **argv){
     int cport, dport;		/* control and data ports. */
-    struct pollfd fds[2];
-    int err, run;
-    char buffer[256];
+    struct pollfd fds[3 + MAX_SESSIONS];
+    int err, run, nworkers, nfds;
+    char drain[64];
+    enum ENGINE engine = E_THREADS;
+    char *primary = NULL;
     if (argc < 3) {
-	printf("Usage: %s control-port data-port\n", argv[0]);
+	printf("Usage: %s control-port data-port [threads|epoll|uring] [numa] [replicaof host:port] [perclient n]\n", argv[0]);
 	exit(1);
     } else {
 	cport = atoi(argv[2]);
 	dport = atoi(argv[1]);
     }
+    // pick the I/O engine for the data port, worker threads by default
+    // and whether to follow a primary as its replica
+    for (int i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "epoll")) {
+            engine = E_EPOLL;
+        } else if (!strcmp(argv[i], "uring")) {
+            engine = E_URING;
+        } else if (!strcmp(argv[i], "numa")) {
+            placement = 1;
+        } else if (!strcmp(argv[i], "replicaof") && i + 1 < argc) {
+            primary = argv[++i];
+        } else if (!strcmp(argv[i], "perclient") && i + 1 < argc) {
+            maxPerClient = atoi(argv[++i]);
+            if (maxPerClient <= 0) {
+                printf("perclient must be at least 1\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "threads")) {
+            printf("Unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    // a client closing early must not kill the server on write
+    signal(SIGPIPE, SIG_IGN);
+    // learn the node layout and home the shards before the store fills
+    if (placement) {
+        printf("Placing workers on %d NUMA node(s)\n", numaInit());
+        if (placeShards() < 0) {
+            printf("Error moving shards to their nodes\n");
+        }
+    }
+    // a replica starts with the primary's store
+    if (primary != NULL) {
+        startReplica(primary);
+    }
     // initialise the queue and the semaphores
-    initQueue(&q);
+    for(int i=0; i<MAX_NODES; i++){
+        initQueue(&q[i]);
+    }
     initSemaphores();
     // initialise the sockets to appropriate ports
     int sockfd,fd;
     struct sockaddr_in sA,sB;
     socklen_t lenA,lenB;
-    sockfd = initSocket(cport,sA,lenA,1);
+    sockfd = initSocket(cport,sA,lenA,MAX_CONTROL);
     fd = initSocket(dport,sB,lenB,BACKLOG);
+    err = pipe(wake_pipe);
+    if(err<0){
+        printf("Error creating pipe\n");
+        exit(1);
+    }
+    err = pipe2(park_pipe, O_NONBLOCK);
+    if(err<0){
+        printf("Error creating pipe\n");
+        exit(1);
+    }
 
-    //Create NTHREADS worker threads
-    for(int i=0; i<NTHREADS; i++){
+    //Create NTHREADS worker threads, the engines serve
+    //every connection from their own event loop instead
+    nworkers = engine == E_THREADS ? NTHREADS : 0;
+    for(int i=0; i<nworkers; i++){
         data_id[i] = i;
         err = pthread_create(&workers[i], NULL, worker, &data_id[i]);
         if(err<0){
             exit(1);
         }
     }
+    // the control port is served by its own thread
+    err = pthread_create(&control_thread, NULL, controller, &sockfd);
+    if(err){
+        printf("Error creating control thread\n");
+        exit(1);
+    }
     puts("Server started.");
-    // add the socket file descriptors to the poll struct
+    // add the data socket, the wake pipe and the park pipe to the poll struct
     int timeout = -1;
-    int connA,connB;
-    fds[0].fd = sockfd;
+    int connB;
+    fds[0].fd = wake_pipe[0];
     fds[1].fd = fd;
+    fds[2].fd = park_pipe[0];
     fds[0].events = POLLIN;
     fds[1].events = POLLIN;
+    fds[2].events = POLLIN;
 
-    run = 1;
+    // the engines return once they have drained
+    if(engine != E_THREADS){
+        // the event loop is the only worker, keep it on one core
+        if(placement && pinThread(workerCpu(0)) < 0){
+            printf("Engine could not be pinned\n");
+        }
+        runEngine(engine, fd, wake_pipe[0]);
+    }
+    run = engine == E_THREADS;
     while(run){
-        err = poll(fds,2,timeout);
+        // and the parked connections, waiting for their next command
+        err = sem_wait(&s_park_lock);
+        if(err<0){
+            printf("Error waiting on semaphore\n");
+            exit(1);
+        }
+        for(nfds = 3; nfds < 3 + nparked; nfds++){
+            fds[nfds].fd = parked[nfds - 3];
+            fds[nfds].events = POLLIN;
+        }
+        err = sem_post(&s_park_lock);
+        if(err<0){
+            printf("Error posting semaphore\n");
+            exit(1);
+        }
+        err = poll(fds,nfds,timeout);
         if(err<0){
+            if(errno == EINTR){
+                continue;
+            }
             exit(1);
         }
         else if(err == 0){
@@ -426,42 +988,68 @@ int main(int argc, char **argv){
         }
         else{
             if(fds[0].revents & POLLIN){
-                // handle control request
-                connA = accept(sockfd,(struct sockaddr*)&sA, &lenA);
-                if(connA<0){
-                    printf("Error accepting connection error from control port %d\n",cport);
-                    exit(1);
-                }
-                else{
-                    printf("Client[%d] control-port Connect Server OK.\n",cport);
+                // the controller received a shutdown command
+                run = 0;
+                continue;
+            }
+            // a worker parked connections, they are polled from now on
+            if(fds[2].revents & POLLIN){
+                while(read(park_pipe[0], drain, sizeof(drain)) > 0);
+            }
+            // a parked connection has a command or closed, back to a worker
+            for(int i=3; i<nfds; i++){
+                if(fds[i].revents && unparkConnection(fds[i].fd)){
+                    pushReady(fds[i].fd);
                 }
-                run = control_data(connA);
             }
-            else if(fds[1].revents & POLLIN){
+            if(fds[1].revents & POLLIN){
                 // handle data request
-                // wait until space is available
-                // and lock the queue lock
-                err = sem_wait(&s_space_avail);
-                if(err<0){
-                    printf("Error waiting on semaphore\n");
-                    exit(1);
-                }
-                err = sem_wait(&s_queue_lock);
-                if(err<0){
-                    printf("Error waiting on semaphore\n");
-                    exit(1);
-                }
-                // accept a connection from the client
+                // accept the connection straight away so the listen
+                // backlog keeps draining even when the workers are saturated
+                lenB = sizeof(sB);
                 connB = accept(fd,(struct sockaddr*)&sB, &lenB);
                 if(connB<0){
+                    // out of descriptors or the client gave up, keep serving
                     printf("Error accepting connection error from data port %d\n",dport);
-                    exit(1);
+                    continue;
                 }
                 else{
                     printf("Client[%d] data-port Connect Server OK.\n",dport);
                 }
-                // push the accepted connection unto the queue for the worker threads
-                push(&q,connB);
+                // a session is kept per descriptor
+                if(connB >= MAX_SESSIONS){
+                    printf("Too many connections, rejected connection %d\n", connB);
+                    rejectConnection(connB, "Server busy, try again later\n");
+                    continue;
+                }
+                // refuse the client if it already holds too many connections
+                if(admitClient(sB.sin_addr.s_addr) < 0){
+                    printf("Client %s over connection limit, rejected\n", inet_ntoa(sB.sin_addr));
+                    rejectConnection(connB, "Too many connections, try again later\n");
+                    continue;
+                }
+                // claim a queue slot without blocking, if the queue is
+                // full reply busy rather than stalling the control port
+                err = sem_trywait(&s_space_avail);
+                if(err<0){
+                    if(errno != EAGAIN){
+                        printf("Error waiting on semaphore\n");
+                        exit(1);
+                    }
+                    printf("Queue full, rejected connection %d\n", connB);
+                    releaseClient(sB.sin_addr.s_addr);
+                    rejectConnection(connB, "Server busy, try again later\n");
+                    continue;
+                }
+                err = sem_wait(&s_queue_lock);
+                if(err<0){
+                    printf("Error waiting on semaphore\n");
+                    exit(1);
+                }
+                // push the accepted connection unto the queue of the node
+                // whose core received it, a queue can't fill up as all of
+                // them together hold at most QUEUE_SIZE connections
+                push(&q[placement ? numaNodeOf(incomingCpu(connB)) : 0],connB);
                 // post work is available for the worker threads 
                 err = sem_post(&s_work_avail);
                 if(err<0){
@@ -475,11 +1063,14 @@ int main(int argc, char **argv){
                     printf("Error posting semaphore\n");
                     exit(1);
                 }
-                printf("Just pushed %d on queue\n", accept);
+                printf("Just pushed %d on queue\n", connB);
             }
         }
     }
-    close(sockfd);
+    // drain: stop accepting and give the workers until the deadline
+    if(engine == E_THREADS){
+        beginDrain();
+    }
     close(fd);
 
     // post the shutdown sempahore for the worker threads to shutdwon
@@ -488,9 +1079,28 @@ int main(int argc, char **argv){
         printf("Error posting semaphore\n");
         exit(1);
     }
+    // turn away the connections still waiting in the queue
+    err = sem_wait(&s_queue_lock);
+    if(err<0){
+        printf("Error waiting on semaphore\n");
+        exit(1);
+    }
+    while((connB = popConnection(0)) != 0){
+        // it was admitted, give its client slot back
+        lenB = sizeof(sB);
+        memset(&sB, 0, lenB);
+        getpeername(connB,(struct sockaddr*)&sB,&lenB);
+        rejectConnection(connB, "Server shutting down\n");
+        releaseClient(sB.sin_addr.s_addr);
+    }
+    err = sem_post(&s_queue_lock);
+    if(err<0){
+        printf("Error posting semaphore\n");
+        exit(1);
+    }
     // its safe to post the work available semaphore as the worker threads
     // will be waiting for this to shutdown
-    for(int i=0; i<NTHREADS; i++){
+    for(int i=0; i<nworkers; i++){
         err = sem_post(&s_work_avail);
         if(err<0){
             printf("Error posting semaphore\n");
@@ -498,13 +1108,38 @@ int main(int argc, char **argv){
         }
     }
     // join all the worker threads
-    for(int i = 0; i<NTHREADS; i++) {
+    for(int i = 0; i<nworkers; i++) {
         err = pthread_join(workers[i], NULL);
          if(err){
             printf("Error joining threads\n");
             exit(1);
          }
     }
+    // the workers are gone, close the connections left parked or ready
+    while(nparked > 0){
+        shutConnection(parked[--nparked]);
+    }
+    while((connB = popReady()) != 0){
+        shutConnection(connB);
+    }
+    drain_time = now_ms() - drain_start;
+    printf("Drained in %ld ms\n", drain_time);
+    // let the controller report the drain and finish
+    err = sem_post(&s_drained);
+    if(err<0){
+        printf("Error posting semaphore\n");
+        exit(1);
+    }
+    err = pthread_join(control_thread, NULL);
+    if(err){
+        printf("Error joining threads\n");
+        exit(1);
+    }
+    close(sockfd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    close(park_pipe[0]);
+    close(park_pipe[1]);
     // function destroys all the semaphores
     destroySemaphores();
 
@@ -0,0 +1,655 @@
+/* Data port sessions and the command dispatch. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include "session.h"
+#include "bufpool.h"
+#include "repl.h"
+
+#define PROMPT "Please enter a command > "
+#define HELLO_REPLY "HELLO 2\n"
+
+void initSession(Session *s, int fd){
+    int on = 1;
+    s->fd = fd;
+    // large values are sent with MSG_ZEROCOPY where the socket supports it
+    s->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+    s->zcsent = s->zcdone = 0;
+    s->ended = 0;
+    s->quiet = 0;
+    s->discard = 0;
+    s->len = 0;
+    s->in = poolAlloc(IN_START);
+    s->multi = 0;
+    s->nqueued = 0;
+    s->nseg = 0;
+    s->outlen = 0;
+    s->out = poolAlloc(OUT_START);
+    if(s->in == NULL || s->out == NULL){
+        printf("Error mallocing resource\n");
+        exit(1);
+    }
+    // greet at connect, a client switching to HELLO skips this
+    sessionText(s, "Welcome to the KV store.\n");
+    sessionText(s, PROMPT);
+}
+
+/*
+* This function drops whatever input is left
+* in a session along with its buffers
+*/
+void dropQueued(Session *s){
+    for(int i=0; i<s->nqueued; i++){
+        poolFree(s->queued[i]);
+    }
+    s->nqueued = 0;
+}
+
+void endSession(Session *s){
+    releaseOutput(s);
+    dropQueued(s);
+    poolFree(s->in);
+    poolFree(s->out);
+    s->in = s->out = NULL;
+}
+
+char *sessionInput(Session *s, int *room){
+    int cap = poolSize(s->in);
+    if(cap - s->len < IN_ROOM){
+        char *in = poolGrow(s->in, s->len, 2 * cap);
+        if(in == NULL){
+            printf("Error mallocing resource\n");
+            exit(1);
+        }
+        s->in = in;
+        cap = poolSize(in);
+    }
+    *room = cap - s->len;
+    return s->in + s->len;
+}
+
+/*
+* This function moves the replies to a bigger buffer
+* the text segments are pointed at their new place
+*/
+void growOutput(Session *s, size_t size){
+    char *out = poolAlloc(size);
+    if(out == NULL){
+        printf("Error mallocing resource\n");
+        exit(1);
+    }
+    memcpy(out, s->out, s->outlen);
+    for(int i=0; i<s->nseg; i++){
+        if(s->refs[i] == NULL){
+            s->iov[i].iov_base = out + ((char *) s->iov[i].iov_base - s->out);
+        }
+    }
+    poolFree(s->out);
+    s->out = out;
+}
+
+/*
+* This function queues a text reply
+* text following text in out is merged into one segment
+*/
+void sessionText(Session *s, const char *text){
+    size_t n = strlen(text);
+    struct iovec *last;
+    if(s->outlen + n > poolSize(s->out)){
+        growOutput(s, 2 * (s->outlen + n));
+    }
+    last = s->nseg > 0 ? &s->iov[s->nseg - 1] : NULL;
+    memcpy(s->out + s->outlen, text, n);
+    if(last != NULL && s->refs[s->nseg - 1] == NULL &&
+       (char *) last->iov_base + last->iov_len == s->out + s->outlen){
+        last->iov_len += n;
+    }
+    else{
+        s->iov[s->nseg].iov_base = s->out + s->outlen;
+        s->iov[s->nseg].iov_len = n;
+        s->refs[s->nseg] = NULL;
+        s->nseg++;
+    }
+    s->outlen += n;
+}
+
+/*
+* This function queues a pinned value as a reply
+* the value is sent from the store and unpinned by releaseOutput
+*/
+void sessionValue(Session *s, Value *v){
+    s->iov[s->nseg].iov_base = v->data;
+    s->iov[s->nseg].iov_len = v->len;
+    s->refs[s->nseg] = v;
+    s->nseg++;
+    sessionText(s, "\n");
+}
+
+void releaseOutput(Session *s){
+    for(int i=0; i<s->nseg; i++){
+        releaseValue(s->refs[i]);
+    }
+    s->nseg = 0;
+    s->outlen = 0;
+    // hand a buffer grown for a burst of replies back to the pool
+    if(s->out != NULL && poolSize(s->out) > OUT_START){
+        poolFree(s->out);
+        s->out = poolAlloc(OUT_START);
+        if(s->out == NULL){
+            printf("Error mallocing resource\n");
+            exit(1);
+        }
+    }
+}
+
+void dispatch(Session *s, enum DATA_CMD cmd, char *key, char *text);
+
+/*
+* This function runs the commands queued since MULTI
+* holding the shard locks of all their keys, so other
+* clients see either none or all of their effects
+*/
+void execTransaction(Session *s){
+    enum DATA_CMD cmds[MULTI_MAX];
+    char *keys[MULTI_MAX], *texts[MULTI_MAX];
+    int n = s->nqueued;
+    s->multi = 0;
+    if(s->aborted){
+        dropQueued(s);
+        sessionText(s, "Transaction aborted\n");
+        return;
+    }
+    // the queued lines were checked when queued, parse them again in place
+    for(int i=0; i<n; i++){
+        parse_d(s->queued[i], &cmds[i], &keys[i], &texts[i]);
+    }
+    lockKeys(keys, n);
+    for(int i=0; i<n; i++){
+        dispatch(s, cmds[i], keys[i], texts[i]);
+    }
+    unlockKeys();
+    dropQueued(s);
+}
+
+/*
+* This function queues a command line between MULTI and EXEC
+* a command that can't be queued aborts the transaction
+* the session takes the pooled copy of the line raw
+*/
+void queueCommand(Session *s, char *raw, enum DATA_CMD cmd){
+    if(cmd >= D_ERR_OL){
+        s->aborted = 1;
+        poolFree(raw);
+        dispatch(s, cmd, NULL, NULL);
+    }
+    else if(s->nqueued == MULTI_MAX){
+        s->aborted = 1;
+        poolFree(raw);
+        sessionText(s, "Error, too many commands in transaction\n");
+    }
+    else{
+        s->queued[s->nqueued++] = raw;
+        sessionText(s, "Queued\n");
+    }
+}
+
+/*
+* This function executes one parsed data command
+* and queues the appropriate reply for the client
+*/
+void dispatch(Session *s, enum DATA_CMD cmd, char *key, char *text){
+    char buffer[LINE + 1];
+    Value *v;
+    int n;
+    // replicas only change through their primary
+    if(isReplica() && (cmd == D_PUT || cmd == D_DELETE || cmd == D_INCR || cmd == D_DECR ||
+                       cmd == D_APPEND || cmd == D_GETSET || cmd == D_CAS)){
+        sessionText(s, "Error, this server is a read-only replica\n");
+        return;
+    }
+    // get a value from the user and return the key if it exists
+    if (cmd == D_GET){
+        // pin the value so a concurrent delete can't free it
+        // while it is being sent straight from the store
+        v = acquireValue(key);
+        // if the value does exist
+        if (v != NULL) {
+            // a value could read like any other reply, frame it for programs
+            if(s->quiet){
+                sessionText(s, "VALUE ");
+            }
+            sessionValue(s,v);
+            return;
+        }
+        else {
+            strncpy(buffer, "No such item.\n", LINE);
+        }
+    }
+    // get a value together with the version to pass to cas
+    else if (cmd == D_GETV){
+        unsigned long long version;
+        v = acquireVersion(key, &version);
+        if (v != NULL) {
+            sprintf(buffer, "%llu ", version);
+            sessionText(s,buffer);
+            sessionValue(s,v);
+            return;
+        }
+        else {
+            strncpy(buffer, "No such item.\n", LINE);
+        }
+    }
+    // start queueing commands for a transaction
+    else if (cmd == D_MULTI){
+        if(s->multi){
+            strncpy(buffer, "Error, MULTI calls can not be nested\n", LINE);
+        }
+        else{
+            s->multi = 1;
+            s->aborted = 0;
+            strncpy(buffer, "OK\n", LINE);
+        }
+    }
+    // run the queued commands as one transaction
+    else if (cmd == D_EXEC){
+        if(s->multi){
+            execTransaction(s);
+            return;
+        }
+        strncpy(buffer, "Error, EXEC without MULTI\n", LINE);
+    }
+    // drop the queued commands
+    else if (cmd == D_DISCARD){
+        if(s->multi){
+            s->multi = 0;
+            dropQueued(s);
+            strncpy(buffer, "Transaction discarded\n", LINE);
+        }
+        else{
+            strncpy(buffer, "Error, DISCARD without MULTI\n", LINE);
+        }
+    }
+    // switch to the non-interactive protocol
+    else if (cmd == D_HELLO){
+        int on = 1;
+        s->quiet = 1;
+        // pooled connections idle for long, let the kernel find dead peers
+        setsockopt(s->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        strncpy(buffer, HELLO_REPLY, LINE);
+    }
+    // check if the client hits return to end connection
+    else if (cmd == D_END) {
+        // Copy terminating connection message to buffer
+        // the connection is closed once the reply is out
+        strncpy(buffer, "Goodbye\n", LINE);
+        s->ended = 1;
+    }
+    // count the number of items in the store
+    else if(cmd == D_COUNT){
+        // get the number number of items in the store using countItems
+        n = countItems();
+        sprintf(buffer,"%d\n",n);
+    }
+    // delete an item using its key
+    else if(cmd == D_DELETE){
+        // use the deleteItem function to delete the key and its value
+        // send the appropriate message according to its result
+        n = deleteItem(key,1);
+        if(n == 0){
+            strncpy(buffer, "Delete successful\n", LINE);
+        }else{
+            strncpy(buffer, "Deletion error occured\n", LINE);
+        }
+    }
+    // check if a key exists
+    else if(cmd == D_EXISTS){
+        n = itemExists(key);
+        if(n>0){
+            strncpy(buffer, "Item exists\n", LINE);
+        }
+        else{
+            strncpy(buffer, "Item doesn't exist\n", LINE);
+        }
+    }
+    // put a key and its value into the store
+    else if(cmd == D_PUT){
+        // created an allocated memory for storing values
+        char *valCopy = malloc(strlen(text)+1);
+        if(valCopy == NULL){
+            printf("Error mallocing resource\n");
+            exit(1);
+        }
+        // copy the value into the allocated memory
+        strncpy(valCopy,text,strlen(text)+1);
+        // use the createItem function to create this item
+        n = createItem(key,valCopy);
+        // check if the item has been created from the returned value
+        if(n == 0){
+            strncpy(buffer, "Item succesfully created\n", LINE);
+        }
+        // check for other occurrences and errors
+        else{
+            // if the item already exist update it
+            if(itemExists(key)>0){
+                // use updateItem to update the value of the required key
+                n = updateItem(key,valCopy);
+                if(n<0){
+                    strncpy(buffer, "Error updating item\n", LINE);
+                }
+                else{
+                    strncpy(buffer, "Key sucsessfully updated\n", LINE);
+                }
+            }
+            else{
+                strncpy(buffer, "Error creating item\n", LINE);
+            }
+        }
+    }
+    // add to or subtract from a counter in one step
+    else if(cmd == D_INCR || cmd == D_DECR){
+        long long delta = 1, result;
+        char *end;
+        if(text != NULL){
+            errno = 0;
+            delta = strtoll(text, &end, 10);
+            if(errno || end == text || *end != '\0'){
+                sessionText(s, "Error, delta is not an integer\n");
+                return;
+            }
+        }
+        if(cmd == D_DECR){
+            // -LLONG_MIN doesn't fit in a long long
+            if(delta == LLONG_MIN){
+                sessionText(s, "Error, delta is out of range\n");
+                return;
+            }
+            delta = -delta;
+        }
+        if(incrItem(key, delta, &result) == 0){
+            sprintf(buffer, "%lld\n", result);
+        }
+        else{
+            strncpy(buffer, "Error, value is not an integer or out of range\n", LINE);
+        }
+    }
+    // append to a value, creating it if missing
+    else if(cmd == D_APPEND){
+        long len = appendItem(key, text);
+        if(len < 0){
+            strncpy(buffer, "Error appending to item\n", LINE);
+        }
+        else{
+            sprintf(buffer, "%ld\n", len);
+        }
+    }
+    // store a value and return the one it replaced
+    else if(cmd == D_GETSET){
+        int err;
+        char *valCopy = strdup(text);
+        if(valCopy == NULL){
+            printf("Error mallocing resource\n");
+            exit(1);
+        }
+        v = getsetItem(key, valCopy, &err);
+        if(v != NULL){
+            // the old value is sent pinned and freed once sent
+            sessionValue(s,v);
+            return;
+        }
+        if(err == 0){
+            strncpy(buffer, "No such item.\n", LINE);
+        }
+        else{
+            free(valCopy);
+            strncpy(buffer, "Error creating item\n", LINE);
+        }
+    }
+    // store a value only if the item is still at the given version
+    else if(cmd == D_CAS){
+        unsigned long long version, current;
+        char *end;
+        errno = 0;
+        version = strtoull(text, &end, 10);
+        if(errno || end == text || *end != ' '){
+            sessionText(s, "Error, use cas key version text\n");
+            return;
+        }
+        char *valCopy = strdup(end + 1);
+        if(valCopy == NULL){
+            printf("Error mallocing resource\n");
+            exit(1);
+        }
+        n = casItem(key, version, valCopy, &current);
+        if(n == 0){
+            sprintf(buffer, "Item updated, version %llu\n", current);
+        }
+        else if(n > 0){
+            free(valCopy);
+            sprintf(buffer, "Version mismatch, current version %llu\n", current);
+        }
+        else{
+            free(valCopy);
+            strncpy(buffer, "No such item.\n", LINE);
+        }
+    }
+    // check if the line is too long
+    else if(cmd == D_ERR_OL){
+        strncpy(buffer, "Error, line is too long\n", LINE);
+    }
+    // check if the command is invalid
+    else if(cmd == D_ERR_INVALID){
+        strncpy(buffer, "Error, invalid command: use get, put, count, exists, delete, incr, decr, append, getset, cas, getv, multi, exec, discard, hello\n", LINE);
+    }
+    // check if the parameters exceed required
+    else if(cmd == D_ERR_LONG){
+        strncpy(buffer, "Error, too many parameters\n", LINE);
+    }
+    // check if parameters aren't enough
+    else if(cmd == D_ERR_SHORT){
+        strncpy(buffer, "Error, too few parameters\n", LINE);
+    }
+    else{
+        strncpy(buffer, "Please try again\n", LINE);
+    }
+    sessionText(s,buffer);
+}
+
+int runCommands(Session *s){
+    char *line, *raw = NULL, *eol;
+    enum DATA_CMD cmd;
+    char *key, *text;
+    int n, done = 0;
+    // each command needs reply segments for a value and the prompt,
+    // an EXEC for the replies of all the queued commands
+    while(!s->ended && s->nseg + 2 * s->nqueued + 3 <= OUT_SEGS){
+        eol = memchr(s->in, '\n', s->len);
+        if(s->discard){
+            // drop the tail of an overlong command up to its end of line
+            n = eol == NULL ? s->len : eol - s->in + 1;
+            memmove(s->in, s->in + n, s->len - n);
+            s->len -= n;
+            s->discard = eol == NULL;
+            if(s->discard){
+                break;
+            }
+            continue;
+        }
+        if(eol == NULL){
+            if(s->len < MAX_LINE){
+                break;
+            }
+            // MAX_LINE bytes without an end of line is an overlong command
+            s->len = 0;
+            s->discard = 1;
+            s->aborted = s->multi;
+            dispatch(s, D_ERR_OL, NULL, NULL);
+        }
+        else{
+            // parse_d works on a NUL terminated copy of the line
+            n = eol - s->in + 1;
+            line = poolAlloc(n + 1);
+            raw = s->multi ? poolAlloc(n + 1) : NULL;
+            if(line == NULL || (s->multi && raw == NULL)){
+                printf("Error mallocing resource\n");
+                exit(1);
+            }
+            memcpy(line, s->in, n);
+            line[n] = '\0';
+            memmove(s->in, s->in + n, s->len - n);
+            s->len -= n;
+            if(raw != NULL){
+                memcpy(raw, line, n + 1);
+            }
+            // use the parse function to parse the line into commands, key and value
+            parse_d(line,&cmd,&key,&text);
+            if(s->multi && cmd != D_MULTI && cmd != D_EXEC && cmd != D_DISCARD && cmd != D_END){
+                queueCommand(s, raw, cmd);
+            }
+            else{
+                poolFree(raw);
+                dispatch(s, cmd, key, text);
+            }
+            poolFree(line);
+        }
+        if(!s->ended && !s->quiet){
+            sessionText(s, PROMPT);
+        }
+        done++;
+    }
+    // hand a buffer grown for a large command back to the pool
+    if(s->len == 0 && poolSize(s->in) > IN_START){
+        poolFree(s->in);
+        s->in = poolAlloc(IN_START);
+        if(s->in == NULL){
+            printf("Error mallocing resource\n");
+            exit(1);
+        }
+    }
+    return done;
+}
+
+/*
+* This function waits for the kernel to report that every
+* MSG_ZEROCOPY send made so far has completed, after which
+* the pages of the values are no longer referenced by the socket
+* returns 0 once they have, (-1) if that takes ZEROCOPY_WAIT ms
+*/
+int waitZerocopy(Session *s){
+    struct pollfd pfd;
+    struct msghdr msg;
+    struct timespec ts;
+    char control[128];
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    long now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    deadline = ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + ZEROCOPY_WAIT;
+    pfd.fd = s->fd;
+    pfd.events = 0;
+    // a notification covers a range of sends, up to ee_data
+    while((int) (s->zcdone - s->zcsent) < 0){
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(s->fd, &msg, MSG_ERRQUEUE) < 0){
+            if(errno != EAGAIN && errno != EINTR){
+                return -1;
+            }
+            // the error queue raises POLLERR once the notification is in
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            now = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+            if(now >= deadline || poll(&pfd, 1, deadline - now) < 0){
+                return -1;
+            }
+            continue;
+        }
+        for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if(serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY){
+                s->zcdone = serr->ee_data + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+* This function gives up on replies the kernel may still
+* be sending from: the values stay pinned and the reply
+* buffer allocated for good, so they can't be reused under
+* it, and the connection is reset when it is closed
+*/
+void abandonOutput(Session *s){
+    struct linger reset = {1, 0};
+    setsockopt(s->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    s->nseg = 0;
+    s->outlen = 0;
+    s->out = poolAlloc(OUT_START);
+    if(s->out == NULL){
+        printf("Error mallocing resource\n");
+        exit(1);
+    }
+}
+
+int flushSession(Session *s){
+    struct msghdr msg;
+    int large = 0, flags = 0, err = 0;
+    ssize_t n;
+    for(int i=0; i<s->nseg; i++){
+        if(s->refs[i] != NULL && s->iov[i].iov_len >= ZEROCOPY_MIN){
+            large = 1;
+        }
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = s->iov;
+    msg.msg_iovlen = s->nseg;
+    // replies holding large values are sent without copying them,
+    // the values stay pinned until the kernel is done with the pages
+    if(large && s->zerocopy){
+        flags = MSG_ZEROCOPY;
+    }
+    while(msg.msg_iovlen > 0){
+        n = sendmsg(s->fd, &msg, flags | MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        // ENOBUFS: over the locked memory limit, fall back to copying
+        if(n < 0 && errno == ENOBUFS && flags){
+            flags = 0;
+            continue;
+        }
+        if(n < 0){
+            err = -1;
+            break;
+        }
+        if(flags){
+            s->zcsent++;
+        }
+        // a short send, go on from where it stopped
+        while(msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len){
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if(msg.msg_iovlen > 0){
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    // the kernel may still be sending from values it hasn't confirmed
+    if(waitZerocopy(s) < 0){
+        abandonOutput(s);
+        return -1;
+    }
+    releaseOutput(s);
+    return err;
+}
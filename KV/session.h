@@ -0,0 +1,99 @@
+/* Header file for data port sessions.
+ * A session holds the state of one data connection: the bytes
+ * read so far and the replies waiting to be written. The command
+ * dispatch works on sessions only, so the same code serves the
+ * worker threads and the event driven I/O engines.
+ * The input and reply buffers come from the buffer pool and grow to
+ * fit commands of up to MAX_LINE bytes and their replies.
+ * Commands between MULTI and EXEC are queued in the session and run
+ * as one transaction when EXEC arrives.
+ * Every session starts with the welcome banner and a prompt.
+ * Clients that send HELLO get the non-interactive protocol from then
+ * on: they skip the banner up to the HELLO reply, and get no prompts,
+ * just one reply line per command (one per queued command for EXEC),
+ * a found GET value as "VALUE <value>", and TCP keep-alive so pooled
+ * connections can stay open.
+ */
+
+#ifndef _session_h_
+#define _session_h_
+
+#include <sys/uio.h>
+#include "kv.h"
+#include "parser.h"
+
+#define IN_START 512
+#define IN_ROOM 256               /* free input space offered to a read */
+#define MAX_LINE (1 << 20)        /* longest command accepted */
+#define OUT_START 4096
+#define OUT_SEGS 48
+#define ZEROCOPY_MIN 16384
+#define ZEROCOPY_WAIT 5000        /* ms to wait for the kernel to finish a zerocopy send */
+#define MULTI_MAX 16
+
+typedef struct session {
+    int fd;
+    int zerocopy;              /* socket has SO_ZEROCOPY enabled */
+    unsigned zcsent;           /* MSG_ZEROCOPY sends made on the socket */
+    unsigned zcdone;           /* and confirmed done by the kernel */
+    int ended;                 /* the client ended the session */
+    int quiet;                 /* non-interactive, no banner or prompts */
+    int discard;               /* skipping the rest of an overlong line */
+    int len;                   /* bytes waiting in in */
+    char *in;
+    int multi;                 /* queueing commands for EXEC */
+    int aborted;               /* a queued command was rejected */
+    int nqueued;
+    char *queued[MULTI_MAX];   /* copies of the queued lines */
+    int nseg;                  /* reply segments waiting in iov */
+    struct iovec iov[OUT_SEGS];
+    Value *refs[OUT_SEGS];     /* pinned values sent from the store */
+    int outlen;                /* bytes of out used by the segments */
+    char *out;
+} Session;
+
+/*
+ * Start a session on a connection and queue the welcome banner.
+ */
+void initSession(Session *s, int fd);
+
+/*
+ * Give the session's buffers back to the pool and unpin its replies.
+ */
+void endSession(Session *s);
+
+/*
+ * Make room for more input, at least IN_ROOM bytes.
+ * POST: *room holds the number of bytes that fit.
+ * RETURNS: where the next input goes, add its length to s->len.
+ */
+char *sessionInput(Session *s, int *room);
+
+/*
+ * Queue a text reply.
+ */
+void sessionText(Session *s, const char *text);
+
+/*
+ * Execute the complete command lines waiting in s->in and queue
+ * their replies. Stops early when the reply space runs low or the
+ * client ends the session, the remaining lines stay in s->in.
+ * RETURNS: the number of commands executed.
+ */
+int runCommands(Session *s);
+
+/*
+ * Drop the queued replies, unpinning any values they reference.
+ */
+void releaseOutput(Session *s);
+
+/*
+ * Write the queued replies to a blocking socket and release them.
+ * Replies sent with MSG_ZEROCOPY are released once the kernel is
+ * done with them, if it isn't within ZEROCOPY_WAIT ms they are kept
+ * for good and the connection is to be closed, it will be reset.
+ * RETURNS: 0 on success, (-1) if the write failed.
+ */
+int flushSession(Session *s);
+
+#endif
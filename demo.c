@@ -3,6 +3,7 @@
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
+#include "tracelog.h"
 
 /*
  * Parameters of the program. The constraints are D < T and
@@ -29,6 +30,24 @@ struct timeval starttime;
  * You can also create functions of your own.
  */
 
+// the lines the threads print, through the logger's thread
+enum { L_MARKER_ENTERS, L_MARKER_TIMEOUT, L_GRABBED, L_FINISHED, L_MARKER_EXITS,
+       L_PANICKING, L_STUDENT_ENTERS, L_STUDENT_TIMEOUT, L_DEMO_STARTS, L_DEMO_ENDS, L_STUDENT_EXITS };
+
+const char *const lines[] = {
+    "%d marker %d: enters lab\n",
+    "%d marker %d: exits lab (timeout)\n",
+    "%d marker %d: grabbed by student %d (job %d)\n",
+    "%d marker %d: finished with student %d (job %d)\n",
+    "%d marker %d: exits lab (finished %d jobs)\n",
+    "%d student %d: starts panicking\n",
+    "%d student %d: enters lab\n",
+    "%d student %d: exits lab (timeout)\n",
+    "%d student %d: starts demo\n",
+    "%d student %d: ends demo\n",
+    "%d student %d: exits lab (finished)\n"
+};
+
 // mutex used for controlling permission to variables
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 // condition to be signalled when a marker has been grabbed
@@ -42,6 +61,8 @@ pthread_cond_t markersAvail = PTHREAD_COND_INITIALIZER;
 
 // keep track of the number of available markers
 int availMarkers;
+// stack of the idle markers' ids, the top one at availMarkers - 1
+int *idleMarkers;
 // keep track of whether there is enough time to run a demo
 // 0 = time available, 1 = time is up
 int timesUp;
@@ -82,6 +103,8 @@ void createData(){
         markArray[j].markerState = 0;
         // set the id of the markers student id to default
         markArray[j].studId = -1;
+        // push the markers so that marker 0 is grabbed first
+        idleMarkers[j] = parameters.M - 1 - j;
     }
 }
 
@@ -140,7 +163,7 @@ void *marker(void *arg) {
     int job = 0;
 
     /* 1. Enter the lab. */
-    printf("%d marker %d: enters lab\n", timenow(), markerID);
+    logEvent(L_MARKER_ENTERS, timenow(), markerID, 0, 0);
 
     /* A marker marks up to N projects. */
     /* 2. Repeat (N times).
@@ -174,7 +197,7 @@ void *marker(void *arg) {
                 exit(1);
             }
             // exit the lab with  timeout
-            printf("%d marker %d: exits lab (timeout)\n", timenow(), markerID);
+            logEvent(L_MARKER_TIMEOUT, timenow(), markerID, 0, 0);
             return NULL;
 
         }
@@ -186,7 +209,7 @@ void *marker(void *arg) {
             exit(1);
         }
         // check if the marker has now been grabbed
-        printf("%d marker %d: grabbed by student %d (job %d)\n", timenow(), markerID, studentID, job + 1);
+        logEvent(L_GRABBED, timenow(), markerID, studentID, job + 1);
         // lock the associated mutex
         err = pthread_mutex_lock(&mutex);
         if(err){
@@ -215,7 +238,7 @@ void *marker(void *arg) {
             if(err){
                 exit(1);
             }
-            printf("%d marker %d: finished with student %d (job %d)\n", timenow(), markerID, studentID, job + 1);
+            logEvent(L_FINISHED, timenow(), markerID, studentID, job + 1);
             // increment the number of jobs completed
             job++;
             err = pthread_mutex_lock(&mutex);
@@ -225,8 +248,8 @@ void *marker(void *arg) {
             // check whether the amount of jobs completed is equal to N
             if(job<parameters.N){
                 // if marker hasn't completed N demos re-enter lab
-                // increment the markers and set markers state to idle
-                availMarkers++;
+                // push the marker on the idle stack and set markers state to idle
+                idleMarkers[availMarkers++] = markerID;
                 markArray[markerID].markerState = 0;
                 // broadcast markers avail to any waiting students
                 err = pthread_cond_broadcast(&markersAvail);
@@ -271,7 +294,7 @@ void *marker(void *arg) {
      // once the marker has completed N demos
      else if((job) == parameters.N){
         // exit the lab appropriately
-        printf("%d marker %d: exits lab (finished %d jobs)\n", timenow(), markerID, parameters.N);
+        logEvent(L_MARKER_EXITS, timenow(), markerID, parameters.N, 0);
      }
     return NULL;
 }
@@ -287,11 +310,11 @@ void *student(void *arg) {
     int count = 0; // counter variable
 
     /* 1. Panic! */
-    printf("%d student %d: starts panicking\n", timenow(), studentID);
+    logEvent(L_PANICKING, timenow(), studentID, 0, 0);
     panic();
 
     /* 2. Enter the lab. */
-    printf("%d student %d: enters lab\n", timenow(), studentID);
+    logEvent(L_STUDENT_ENTERS, timenow(), studentID, 0, 0);
 
     /* 3. Grab K markers. */
     // lock the associated mutex
@@ -313,39 +336,31 @@ void *student(void *arg) {
         if(err){
             exit(1);
         }
-        printf("%d student %d: exits lab (timeout)\n", timenow(), studentID);
+        logEvent(L_STUDENT_TIMEOUT, timenow(), studentID, 0, 0);
         return NULL;
     }
 
     // test for the satisfied condition variable
     // i.e if there enough  available Markers
     if(availMarkers >= parameters.K){
-        // proceed to grabbing K markers
+        // set the demo start and finish states
+        studArray[studentID].demoStarted  = 0;
+        studArray[studentID].demoFinished  = 0;
+        // proceed to grabbing K markers, popping them off the idle stack
         for(int i=0; i<parameters.K; i++){
-            // search for idle markers to grab
-            for(int j=0; j<parameters.M; j++){
-                if(markArray[j].markerState == 0){
-                    // set the selected marker to a grabbed state
-                    markArray[j].markerState = 1;
-                    // set the studentId of the grabbed marker to this student
-                    markArray[j].studId = studentID;
-                    // decrease the number of available markers since they've been grabbed
-                    availMarkers--;
-                    // increment the count variable to keep count of the markers grabbed
-                    count++;
-                    // set the demo start and finish states
-                    studArray[studentID].demoStarted  = 0;
-                    studArray[studentID].demoFinished  = 0;
-                    // signal to the idle marker waiting to be grabbed and wake it up
-                    if(markArray[j].markerState == 1){
-                        err = pthread_cond_broadcast(&grabCond);
-                        if(err){
-                            exit(1);
-                        }
-                    }
-                    break;
-                }
-            }
+            // decrease the number of available markers since they've been grabbed
+            int j = idleMarkers[--availMarkers];
+            // set the selected marker to a grabbed state
+            markArray[j].markerState = 1;
+            // set the studentId of the grabbed marker to this student
+            markArray[j].studId = studentID;
+            // increment the count variable to keep count of the markers grabbed
+            count++;
+        }
+        // wake the grabbed markers waiting to be grabbed, once for all K
+        err = pthread_cond_broadcast(&grabCond);
+        if(err){
+            exit(1);
         }
         // unlock the associated mutex as you are about to break out of the for loop
         err = pthread_mutex_unlock(&mutex);
@@ -380,9 +395,9 @@ void *student(void *arg) {
                 exit(1);
             }
             // proceed to starting and ending the demo
-            printf("%d student %d: starts demo\n", timenow(), studentID);
+            logEvent(L_DEMO_STARTS, timenow(), studentID, 0, 0);
             demo();
-            printf("%d student %d: ends demo\n", timenow(), studentID);
+            logEvent(L_DEMO_ENDS, timenow(), studentID, 0, 0);
             // relock the associated mutex after printing
             err = pthread_mutex_lock(&mutex);
             if(err){
@@ -400,7 +415,7 @@ void *student(void *arg) {
             if(err){
                 exit(1);
             }
-            printf("%d student %d: exits lab (finished)\n", timenow(), studentID);
+            logEvent(L_STUDENT_EXITS, timenow(), studentID, 0, 0);
         }
     }
     return NULL;
@@ -415,9 +430,10 @@ void run() {
     // allocate memory for student and marker array data
     studArray = (StudData *)malloc(parameters.S*sizeof(StudData));
     markArray = (MarkData *)malloc(parameters.M*sizeof(MarkData));
+    idleMarkers = (int *)malloc(parameters.M*sizeof(int));
 
     // error handling
-    if(markArray == NULL || studArray == NULL){ /* Test to see if the allocation of memory failed */
+    if(markArray == NULL || studArray == NULL || idleMarkers == NULL){ /* Test to see if the allocation of memory failed */
         puts("Out of memory!");
         exit(1);
     }
@@ -429,6 +445,8 @@ void run() {
         parameters.N,
         parameters.T,
         parameters.D);
+    fflush(stdout);
+    logStart(lines);
     gettimeofday(&starttime, NULL);  /* Save start of simulated time */
 
     /* Create S student threads */
@@ -485,10 +503,12 @@ void run() {
         ok = pthread_join(markerT[i], NULL);
          if (ok != 0) { abort(); }
     }
+    logStop();
 
     /* Free the resources that have been created for memory allocation */
     free(studArray);
     free(markArray);
+    free(idleMarkers);
 }
 
 /*
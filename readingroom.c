@@ -3,17 +3,37 @@
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include "roomlock.h"
+#include "tracelog.h"
+
+RoomLock room;  //the room, admits readers together and writers alone, writers first
+
+//the lines the threads log, printed by the logger's thread
+enum { L_NEW_READER, L_READER_WAITING, L_READER_ENTERS, L_READING, L_DONE_READING, L_READER_LEAVES,
+       L_NEW_WRITER, L_WRITER_WAITING, L_WRITER_ENTERS, L_WRITING, L_DONE_WRITING, L_WRITER_LEAVES,
+       L_IN_ROOM, L_NO_IN_ROOM, L_IS_WRITER };
+
+const char *const lines[] = {
+    "%i: New reader %i (delay=%i).\n",
+    "%i: Reader %i waiting ...\n",
+    "%i: Reader %i enters room.\n",
+    "%i: Reader %i reading ...\n",
+    "%i: Reader %i done reading.\n",
+    "%i: Reader %i leaves room.\n",
+    "%i: New writer %i (delay=%i).\n",
+    "%i: Writer %i waiting ...\n",
+    "%i: Writer %i enters room.\n",
+    "%i: Writer %i writing ...\n",
+    "%i: Writer %i done writing.\n",
+    "%i: Writer %i leaves room.\n",
+    "No of people in room %d\n",
+    "No in room = %d\n",
+    "id=%i isWriter = %i\n"
+};
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;   //mutex intialisation
-/*condition variables initialisation*/
-pthread_cond_t writerDone = PTHREAD_COND_INITIALIZER; //condition variable for when the writer is done
-pthread_cond_t roomEmpty = PTHREAD_COND_INITIALIZER;  //condition variable for when the room becomes empty
-/*global variables initialisation*/
-int roomOccupiedbyWriter = 0;  //variable determining if the room is occupied by a writer
-int noInRoom = 0;  //variable used to count to number of people currently in the room
-int writerWating = 0; //variable used to determine if a writer is currently waiting
-int writerState = 0;  //variable used to determine if the writer is done writing
-int readerState = 0;  //variable used to determine if the reader is done reading
 /* Do not change this code. */
 
 struct timeval time0;
@@ -35,15 +55,15 @@ void xwait(int delay) {
 }
 
 void read_documents(int delay, int id) {
-    printf("%i: Reader %i reading ...\n", now(), id);
+    logEvent(L_READING, now(), id, 0, 0);
     xwait(delay);
-    printf("%i: Reader %i done reading.\n", now(), id);
+    logEvent(L_DONE_READING, now(), id, 0, 0);
 }
 
 void write_documents(int delay, int id) {
-    printf("%i: Writer %i writing ...\n", now(), id);
+    logEvent(L_WRITING, now(), id, 0, 0);
     xwait(delay);
-    printf("%i: Writer %i done writing.\n", now(), id);
+    logEvent(L_DONE_WRITING, now(), id, 0, 0);
 }
 
 typedef struct _info {
@@ -54,107 +74,212 @@ typedef struct _info {
 
 /* End of code to leave alone. */
 
-//reader thread function
-void* reader(void* p) {
-    info *param = (info*) p;
-    info i = *param;
-    free(p);
-    int err;
+int vclock = -1;  //the virtual clock in ticks, -1 when running in real time
+int tickUs = 10000;  //the length of a tick in pool mode in microseconds
 
-    /* Print this line when a new reader is created, before any synchronisation operations. */
-    printf("%i: New reader %i (delay=%i).\n", now(), i.id, i.delay);
+//the time in ticks for the virtual and pool modes: the virtual clock,
+//or real time since time0 in ticks of tickUs, 1/100 s like now() by default
+int tick() {
+    if (vclock >= 0) { return vclock; }
+    struct timeval _now;
+    gettimeofday(&_now, NULL);
+    return ((_now.tv_sec - time0.tv_sec) * 1000000L +
+            (_now.tv_usec - time0.tv_usec)) / tickUs;
+}
 
-    //lock the associated mutex
-    err = pthread_mutex_lock(&mutex);
-    if(err){
-        printf("Error locking mutex with errno %d\n",err);
+/*
+Statistics, kept when run with -s: when each participant arrived,
+started waiting, entered and left the room, and the room lock's own
+counters. At the end they are printed as histograms of the waits and
+stays, and the room's occupancy after every change goes to a CSV file.
+*/
+enum { ARRIVED, WAITED, ENTERED, LEFT };   //what a participant does, in order
+
+typedef struct _stay {
+    long at[4];     //when it did each, ns since the start, -1 if it didn't
+    int isWriter;
+} stay;
+
+//a change of the room's occupancy, for the timeline
+typedef struct _change {
+    long time;
+    int what;
+    int isWriter;
+    int waited;
+} change;
+
+char *statsFile = NULL;  //the occupancy CSV, NULL when not keeping statistics
+stay *stays = NULL;      //by participant id - 1
+int nStays = 0;
+long startNs;
+struct roomStats lockStats;
+long poolWakeups = 0, poolSpurious = 0;  //pool threads woken with a step due or not
+
+long monotonicNs() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+//ns since the start, in virtual time the ticks of the virtual clock
+long sinceStart() {
+    if (vclock >= 0) { return (long) vclock * tickUs * 1000; }
+    return monotonicNs() - startNs;
+}
+
+void addTime(long *hist, long ns) {
+    int b = ns > 1 ? 63 - __builtin_clzl(ns) : 0;
+    hist[b < ROOM_BUCKETS ? b : ROOM_BUCKETS - 1]++;
+}
+
+//start keeping statistics for n participants, after the room is initialised
+void statsStart(int n) {
+    if (statsFile == NULL) { return; }
+    stays = malloc(n * sizeof(stay));
+    if (stays == NULL) {
+        abort();
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = ARRIVED; j <= LEFT; j++) { stays[i].at[j] = -1; }
+    }
+    nStays = n;
+    memset(&lockStats, 0, sizeof(lockStats));
+    if (roomCount(&room, &lockStats)) { abort(); }
+    startNs = monotonicNs();
+}
+
+//participant id did what, only its own thread or step calls this
+void note(int id, int isWriter, int what) {
+    if (stays == NULL) { return; }
+    stays[id - 1].isWriter = isWriter;
+    stays[id - 1].at[what] = sinceStart();
+}
+
+void printTimes(const char *what, long *hist, long total, long max) {
+    long n = 0;
+    for (int i = 0; i < ROOM_BUCKETS; i++) { n += hist[i]; }
+    printf("%s: %ld times, mean %ld ns, max %ld ns\n", what, n, n ? total / n : 0, max);
+    for (int i = 0; i < ROOM_BUCKETS; i++) {
+        if (hist[i]) { printf("  from %12ld ns %10ld\n", i ? 1L << i : 0, hist[i]); }
+    }
+}
+
+//leaves before anything else at the same time, so the room never looks fuller than it was
+int changeOrder(const void *a, const void *b) {
+    const change *x = a, *y = b;
+    if (x->time != y->time) { return x->time < y->time ? -1 : 1; }
+    return (x->what == LEFT ? -1 : x->what) - (y->what == LEFT ? -1 : y->what);
+}
+
+//write the occupancy after every change, those at the same time together
+void writeTimeline() {
+    change *c = malloc(3 * (size_t) nStays * sizeof(change));
+    int n = 0, in[2] = {0, 0}, waiting[2] = {0, 0};
+    FILE *f = fopen(statsFile, "w");
+    if (c == NULL || f == NULL) {
+        printf("Error writing %s\n", statsFile);
         exit(1);
     }
-    /*
-    If a writer is currently waiting to enter a room,
-    reader must wait for associated condition variable
-    */
-    if(writerWating == 1){
-        /* This line must be printed only if the reader has to wait. */
-        printf("%i: Reader %i waiting ...\n", now(), i.id);
-        while(writerWating == 1){
-            // reader must wait for writer done condition
-            err = pthread_cond_wait(&writerDone,&mutex);
-            if(err){
-                printf("Error waiting for condition variable with errno %d\n",err);
-                exit(1);
+    for (int i = 0; i < nStays; i++) {
+        for (int j = WAITED; j <= LEFT; j++) {
+            if (stays[i].at[j] >= 0) {
+                change e = {stays[i].at[j], j, stays[i].isWriter, stays[i].at[WAITED] >= 0};
+                c[n++] = e;
             }
         }
     }
-    /*
-    If the room is currently occupied by a writer,
-    reader must wait for associated condition variable
-    */
-    else if(roomOccupiedbyWriter == 1){
-         /* This line must be printed only if the reader has to wait. */
-        printf("%i: Reader %i waiting ...\n", now(), i.id);
-        while(roomOccupiedbyWriter == 1){
-            // reader must wait for writer done condition
-            err = pthread_cond_wait(&writerDone,&mutex);
-            if(err){
-                printf("Error waiting for condition variable with errno %d\n",err);
-                exit(1);
-            }
+    qsort(c, n, sizeof(change), changeOrder);
+    fprintf(f, "time_ns,readers_in,writers_in,readers_waiting,writers_waiting\n");
+    for (int i = 0; i < n; i++) {
+        if (c[i].what == WAITED) {
+            waiting[c[i].isWriter]++;
+        } else if (c[i].what == ENTERED) {
+            in[c[i].isWriter]++;
+            waiting[c[i].isWriter] -= c[i].waited;
+        } else {
+            in[c[i].isWriter]--;
+        }
+        if (i + 1 == n || c[i + 1].time != c[i].time) {
+            fprintf(f, "%ld,%d,%d,%d,%d\n", c[i].time, in[0], in[1], waiting[0], waiting[1]);
         }
     }
-    /*
-    If the room is not occupied by a writer,
-    reader can proceed to entering the room
-    */
-    if(roomOccupiedbyWriter == 0){
-       /* Print this line when the reader enters the room. */
-        printf("%i: Reader %i enters room.\n", now(), i.id);
-        noInRoom++; // increment the number of people in the room
-        readerState = 1; // change the reader's state to reflect entering the room
-    }
-    //unlock the associated mutex
-    err = pthread_mutex_unlock(&mutex);
-    if(err){
-        exit(1);
+    fclose(f);
+    free(c);
+}
+
+//print the histograms and write the timeline, once every participant has left
+void statsEnd() {
+    //waits and stays of readers, then of writers
+    long hist[4][ROOM_BUCKETS], total[4] = {0, 0, 0, 0}, max[4] = {0, 0, 0, 0};
+    const char *names[4] = {"reader wait to enter", "reader time in room",
+                            "writer wait to enter", "writer time in room"};
+    if (stays == NULL) { return; }
+    if (roomCount(&room, NULL)) { abort(); }
+    memset(hist, 0, sizeof(hist));
+    for (int i = 0; i < nStays; i++) {
+        long *at = stays[i].at;
+        long t[2] = {at[ENTERED] - at[ARRIVED], at[LEFT] - at[ENTERED]};
+        for (int j = 0; j < 2; j++) {
+            int k = 2 * stays[i].isWriter + j;
+            addTime(hist[k], t[j]);
+            total[k] += t[j];
+            if (t[j] > max[k]) { max[k] = t[j]; }
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        printTimes(names[k], hist[k], total[k], max[k]);
     }
+    printTimes("room queue guard held", lockStats.guardHeld, lockStats.guardTotal, lockStats.guardMax);
+    printf("room wakeups: %ld useful, %ld spurious\n", lockStats.wakeups, lockStats.spurious);
+    if (poolWakeups + poolSpurious) {
+        printf("pool thread wakeups: %ld useful, %ld spurious\n", poolWakeups, poolSpurious);
+    }
+    writeTimeline();
+    free(stays);
+    stays = NULL;
+}
+
+//reader thread function
+void* reader(void* p) {
+    info *param = (info*) p;
+    info i = *param;
+    free(p);
+    int err;
+
+    /* Print this line when a new reader is created, before any synchronisation operations. */
+    logEvent(L_NEW_READER, now(), i.id, i.delay, 0);
+    note(i.id, 0, ARRIVED);
+
     /*
-    Once the reader has entered the room,
-    can proceed to reading documents
+    If a writer is in the room or waiting to enter it,
+    the reader must wait until the writers are done
     */
-    if(readerState == 1){
-         /* Execute this line when it is safe to do so. */
-        read_documents(i.delay, i.id);
+    err = rdtrylock(&room);
+    if(err == EBUSY){
+        /* This line must be printed only if the reader has to wait. */
+        logEvent(L_READER_WAITING, now(), i.id, 0, 0);
+        note(i.id, 0, WAITED);
+        err = rdlock(&room);
     }
-
-    //lock the associated mutex
-    err = pthread_mutex_lock(&mutex);
     if(err){
-        printf("Error locking mutex with errno %d\n",err);
+        printf("Error entering room with errno %d\n",err);
         exit(1);
     }
+    note(i.id, 0, ENTERED);
+    /* Print this line when the reader enters the room. */
+    logEvent(L_READER_ENTERS, now(), i.id, 0, 0);
+    /* Execute this line when it is safe to do so. */
+    read_documents(i.delay, i.id);
     /* Print this line when the reader leaves the room. */
-    printf("%i: Reader %i leaves room.\n", now(), i.id);
-    noInRoom--; // decrement the number of people in the room
-    readerState = 0;  // change the reader's state to reflect leaving the room
-    /*
-    If the number of readers in the room is zero,
-    signal that the room is empty for waiting writers
-    */
-    if(noInRoom == 0){
-        // reader signals the room empty condition
-        err = pthread_cond_signal(&roomEmpty);
-        if(err){
-            printf("Error signalling condition variable with errno %d\n",err);
-            exit(1);
-        }
-    }
-    printf("No of people in room %d\n",noInRoom);
-    //unlock the associated mutex
-    err = pthread_mutex_unlock(&mutex);
+    logEvent(L_READER_LEAVES, now(), i.id, 0, 0);
+    note(i.id, 0, LEFT);
+    //the last reader out lets a waiting writer in
+    err = rdunlock(&room);
     if(err){
-        printf("Error unlocking mutex with errno %d\n",err);
+        printf("Error leaving room with errno %d\n",err);
         exit(1);
     }
+    logEvent(L_IN_ROOM, roomReaders(&room), 0, 0, 0);
 
     return NULL;
 }
@@ -167,120 +292,383 @@ void* writer(void* p) {
     int err;
 
     /* Print this line before the first synchronisation operation. */
-    printf("%i: New writer %i (delay=%i).\n", now(), i.id, i.delay);
+    logEvent(L_NEW_WRITER, now(), i.id, i.delay, 0);
+    note(i.id, 1, ARRIVED);
 
-    //lock the associated mutex
-    err = pthread_mutex_lock(&mutex);
-    if(err){
-        printf("Error locking mutex with errno %d\n",err);
-        exit(1);
-    }
-    writerWating = 1;  //initialise that the writer is waiting
     /*
-    If the room is currently occupied by another writer,
-    wait for the associated condition variable
+    If anyone is in the room the writer waits for it to be empty,
+    readers arriving meanwhile wait behind the writer
     */
-    if(roomOccupiedbyWriter == 1){
-        while(roomOccupiedbyWriter == 1){
-             /* Print this line only if the writer has to wait. */
-            printf("%i: Writer %i waiting ...\n", now(), i.id);
-            // writer must wait for the current writer to be done
-            err = pthread_cond_wait(&roomEmpty,&mutex);
-            if(err){
-                printf("Error waiting for condition variable with errno %d\n",err);
-                exit(1);
-            }
-        }
+    err = wrtrylock(&room);
+    if(err == EBUSY){
+        /* Print this line only if the writer has to wait. */
+        logEvent(L_WRITER_WAITING, now(), i.id, 0, 0);
+        note(i.id, 1, WAITED);
+        err = wrlock(&room);
     }
-    /*
-    Otherwise if the room is currently not occupied by a writer,
-    check if there are any readers in the room
-    */
-    else{
-        //while the room is currently occupied by any number of readers
-       while(noInRoom != 0){
-            /* Print this line only if the writer has to wait. */
-            printf("%i: Writer %i waiting ...\n", now(), i.id);
-            //wait for the room to be empty to proceed
-            err = pthread_cond_wait(&roomEmpty,&mutex);
-            if(err){
-                printf("Error waiting for condition variable with errno %d\n",err);
-                exit(1);
-            }
-        }
+    if(err){
+        printf("Error entering room with errno %d\n",err);
+        exit(1);
     }
-    /*
-    Once the room becomes empty,
-    writer can proceed to entering the room
-    */
-    if(noInRoom == 0){
-        /* Print this line when the writer enters the room. */
-        printf("%i: Writer %i enters room.\n", now(), i.id);
-    }
-    roomOccupiedbyWriter = 1; // initialise that the room is occupied by a writer
-    writerState = 1; // change the writers state to simulate entering the room
-    writerWating = 0; //writer is now done waiting and entered room
-    //unlock the associated mutex
-    err = pthread_mutex_unlock(&mutex);
+    note(i.id, 1, ENTERED);
+    /* Print this line when the writer enters the room. */
+    logEvent(L_WRITER_ENTERS, now(), i.id, 0, 0);
+    logEvent(L_NO_IN_ROOM, roomReaders(&room), 0, 0, 0);
+    /* Execute this line when it is safe to do so. */
+    write_documents(i.delay, i.id);
+    /* Print this line when the writer leaves the room. */
+    logEvent(L_WRITER_LEAVES, now(), i.id, 0, 0);
+    note(i.id, 1, LEFT);
+    //waiting writers go next, otherwise the waiting readers
+    err = wrunlock(&room);
     if(err){
-        printf("Error unlocking mutex with errno %d\n",err);
+        printf("Error leaving room with errno %d\n",err);
         exit(1);
     }
-    printf("No in room = %d\n",noInRoom);
-    /*
-    Once the writer has entered the room,
-    can proceed to writing documents
-    */
-    if(writerState == 1){
-         /* Execute this line when it is safe to do so. */
-        write_documents(i.delay, i.id);
+    logEvent(L_IN_ROOM, roomReaders(&room), 0, 0, 0);
+    return NULL;
+}
+
+/*
+Virtual time simulation: no threads and no sleeping. Every reader and
+writer is a small state machine whose steps are events on a heap ordered
+by virtual time, then by the order they were scheduled. The steps take
+the room lock through its Async functions, so the lock and its policy
+are what gets simulated: a participant that has to wait joins the room's
+queue, and whoever lets it in schedules its next step. A run prints the
+same lines as the threaded one and is the same for the same seed.
+*/
+enum { ARRIVE, ENTER, LEAVE };   //the events of a participant
+
+typedef struct _event {
+    int time;   //time in ticks, 1/100 s like tick()
+    long seq;   //scheduling order, breaks ties in time
+    int who;    //index of the participant
+    int kind;
+} event;
+
+typedef struct _participant {
+    int id;
+    int delay;
+    int isWriter;
+    int arrived;   //when it arrived and entered, for the longest wait
+    int entered;
+    struct roomWaiter wait;   //its place in the room's queue
+    int gate;      //counts the arrival step and the room letting it in
+} participant;
+
+event *heap;
+int nEvents = 0;
+long nScheduled = 0;
+
+participant *people;
+
+pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;  //guards the event heap
+pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;     //signalled when a step falls due
+pthread_cond_t timerCond = PTHREAD_COND_INITIALIZER;    //signalled for the thread timing the earliest step
+int timing = 0;   //1 while a pool thread waits for the earliest step to fall due
+int nPeople = 0;
+int nDone = 0;
+
+int before(event *a, event *b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+void schedule(int time, int who, int kind) {
+    int i = nEvents++;
+    event e = {time, nScheduled++, who, kind};
+    while (i > 0 && before(&e, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
     }
+    heap[i] = e;
+}
 
-    //lock the associated mutex
-    err = pthread_mutex_lock(&mutex);
-    if(err){
-        printf("Error locking mutex with errno %d\n",err);
+event nextEvent() {
+    event top = heap[0], last = heap[--nEvents];
+    int i = 0, child;
+    while ((child = 2 * i + 1) < nEvents) {
+        if (child + 1 < nEvents && before(&heap[child + 1], &heap[child])) { child++; }
+        if (!before(&heap[child], &last)) { break; }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+//schedule a step, for the simulation or a pool thread
+void post(int time, int who, int kind) {
+    int err = pthread_mutex_lock(&poolMutex);
+    if (err) {
+        printf("Error locking mutex with errno %d\n", err);
         exit(1);
     }
-     /* Print this line when the writer leaves the room. */
-    printf("%i: Writer %i leaves room.\n", now(), i.id);
-    writerState = 0; // change writer's state to reflect leaving the room
-    roomOccupiedbyWriter = 0; // the room is no longer occupied by the writer
-    printf("No of people in room %d\n",noInRoom);
-    /*
-    If another writer is waiting to enter,
-    signal the associated condition variable
-    */
-    if(writerWating == 1){
-        //signal that the room is now empty to enter
-        err = pthread_cond_signal(&roomEmpty);
-        if(err){
-            printf("Error signalling condition variable with errno %d\n",err);
-            exit(1);
+    schedule(time, who, kind);
+    //steps post steps, so a later one is timed once the poster is back in the pool
+    if (time <= tick()) {
+        pthread_cond_signal(&poolCond);
+    } else if (timing && heap[0].seq == nScheduled - 1) {
+        pthread_cond_signal(&timerCond);
+    }
+    pthread_mutex_unlock(&poolMutex);
+}
+
+//the participant is in the room, it leaves after its delay
+void admitted(participant *p) {
+    p->entered = tick();
+    note(p->id, p->isWriter, ENTERED);
+    //what read_documents and write_documents log, the delay passes on the heap
+    if (p->isWriter) {
+        logEvent(L_WRITER_ENTERS, tick(), p->id, 0, 0);
+        logEvent(L_NO_IN_ROOM, roomReaders(&room), 0, 0, 0);
+        logEvent(L_WRITING, tick(), p->id, 0, 0);
+    } else {
+        logEvent(L_READER_ENTERS, tick(), p->id, 0, 0);
+        logEvent(L_READING, tick(), p->id, 0, 0);
+    }
+    post(tick() + p->delay, p - people, LEAVE);
+}
+
+//called by whoever lets a waiting participant in, the arrival step
+//may not have finished yet, the second of the two moves it on
+void resumed(struct roomWaiter *w) {
+    participant *p = (participant*) ((char*) w - offsetof(participant, wait));
+    if (__atomic_add_fetch(&p->gate, 1, __ATOMIC_ACQ_REL) == 2) {
+        post(tick(), p - people, ENTER);
+    }
+}
+
+void arrive(participant *p) {
+    int err;
+    p->arrived = tick();
+    if (p->isWriter) {
+        logEvent(L_NEW_WRITER, tick(), p->id, p->delay, 0);
+        note(p->id, 1, ARRIVED);
+        err = wrlockAsync(&room, &p->wait, resumed);
+    } else {
+        logEvent(L_NEW_READER, tick(), p->id, p->delay, 0);
+        note(p->id, 0, ARRIVED);
+        err = rdlockAsync(&room, &p->wait, resumed);
+    }
+    if (err == EINPROGRESS) {
+        logEvent(p->isWriter ? L_WRITER_WAITING : L_READER_WAITING, tick(), p->id, 0, 0);
+        note(p->id, p->isWriter, WAITED);
+        if (__atomic_add_fetch(&p->gate, 1, __ATOMIC_ACQ_REL) < 2) {
+            return;
         }
+    } else if (err) {
+        printf("Error entering room with errno %d\n", err);
+        exit(1);
     }
-    /*
-    If there are no waiting writers,
-    broadcast to the waiting readers that the writer is done
-    */
-    else{
-        // broadcast that the writer is done to the waiting readers
-        err = pthread_cond_broadcast(&writerDone);
-        if(err){
-          printf("Error broadcasting condition variable with errno %d\n",err);
-          exit(1);
+    admitted(p);
+}
+
+//the participant leaves, the lock lets the next writer or the waiting readers in
+void leave(participant *p) {
+    note(p->id, p->isWriter, LEFT);
+    if (p->isWriter) {
+        logEvent(L_DONE_WRITING, tick(), p->id, 0, 0);
+        logEvent(L_WRITER_LEAVES, tick(), p->id, 0, 0);
+        wrunlock(&room);
+    } else {
+        logEvent(L_DONE_READING, tick(), p->id, 0, 0);
+        logEvent(L_READER_LEAVES, tick(), p->id, 0, 0);
+        rdunlockAsync(&room);
+    }
+    logEvent(L_IN_ROOM, roomReaders(&room), 0, 0, 0);
+    pthread_mutex_lock(&poolMutex);
+    //wake the pool to finish once everyone has left
+    if (++nDone == nPeople) {
+        pthread_cond_broadcast(&poolCond);
+        pthread_cond_broadcast(&timerCond);
+    }
+    pthread_mutex_unlock(&poolMutex);
+}
+
+void runStep(event e) {
+    if (e.kind == ARRIVE) {
+        arrive(&people[e.who]);
+    } else if (e.kind == ENTER) {
+        admitted(&people[e.who]);
+    } else {
+        leave(&people[e.who]);
+    }
+}
+
+//draw n participants, one in writerRate a writer, and schedule their arrivals
+void draw(int n, int writerRate, int seed) {
+    int arrival = 0;
+    printf("Random seed: %i.\n", seed);
+    srandom(seed);
+    //arrive, enter and leave, at most three events each
+    heap = malloc(3 * (size_t) n * sizeof(event));
+    people = calloc(n, sizeof(participant));
+    if (heap == NULL || people == NULL) {
+        abort();
+    }
+    //the same draws as the threaded run, arrivals spaced as xwait spaces them
+    for (int i = 0; i < n; i++) {
+        people[i].id = i + 1;
+        people[i].delay = (random() % 6) + (random() % 6) + 2;
+        people[i].isWriter = (random() % writerRate) == 0;
+        printf("id=%i isWriter = %i\n", i, people[i].isWriter);
+        schedule(arrival, i, ARRIVE);
+        arrival += random() % 5;
+    }
+}
+
+//run n participants, one in writerRate a writer, in virtual time
+int simulate(int n, int writerRate, int seed) {
+    int longestWait = 0;
+    if (roomInit(&room, ROOM_WRITERS)) {
+        abort();
+    }
+    nPeople = n;
+    draw(n, writerRate, seed);
+    fflush(stdout);
+    logStart(lines);
+    vclock = 0;
+    statsStart(n);
+    while (nEvents > 0) {
+        event e = nextEvent();
+        vclock = e.time;
+        runStep(e);
+    }
+    logStop();
+    for (int i = 0; i < n; i++) {
+        if (people[i].entered - people[i].arrived > longestWait) {
+            longestWait = people[i].entered - people[i].arrived;
         }
     }
-    //unlock the associated mutex
-    err = pthread_mutex_unlock(&mutex);
-    if(err){
-        printf("Error unlocking mutex with errno %d\n",err);
-        exit(1);
+    printf("Simulated %i participants in %i ticks, longest wait %i ticks.\n", n, vclock, longestWait);
+    statsEnd();
+    free(heap);
+    free(people);
+    return 0;
+}
+
+/*
+Pool mode: the same state machines in real time, run by a fixed pool
+of threads instead of a thread each. A participant that waits in the
+room's queue costs no thread while it waits; the thread that lets it
+in posts its next step. Threads and scheduling cost scale with the
+pool, not with the number of participants.
+*/
+
+//a pool thread, runs the steps as they fall due
+void* poolWorker(void* p) {
+    struct timespec due;
+    event e;
+    int woken = 0;
+    pthread_mutex_lock(&poolMutex);
+    while (nDone < nPeople) {
+        if (woken) {
+            if (nEvents > 0 && heap[0].time <= tick()) { poolWakeups++; } else { poolSpurious++; }
+            woken = 0;
+        }
+        //one thread times the earliest step, the others wait until one falls due
+        if (nEvents == 0 || (timing && heap[0].time > tick())) {
+            pthread_cond_wait(&poolCond, &poolMutex);
+            woken = 1;
+            continue;
+        }
+        if (heap[0].time > tick()) {
+            long us = time0.tv_usec + (long) heap[0].time * tickUs;
+            due.tv_sec = time0.tv_sec + us / 1000000;
+            due.tv_nsec = (us % 1000000) * 1000;
+            timing = 1;
+            pthread_cond_timedwait(&timerCond, &poolMutex, &due);
+            timing = 0;
+            woken = 1;
+            continue;
+        }
+        e = nextEvent();
+        //more due at once, let another thread run them meanwhile
+        if (nEvents > 0 && heap[0].time <= tick()) {
+            pthread_cond_signal(&poolCond);
+        }
+        pthread_mutex_unlock(&poolMutex);
+        runStep(e);
+        pthread_mutex_lock(&poolMutex);
     }
+    //let the other threads see we are done
+    pthread_cond_broadcast(&poolCond);
+    pthread_cond_broadcast(&timerCond);
+    pthread_mutex_unlock(&poolMutex);
     return NULL;
 }
 
-int main(void) {
+//run n participants, one in writerRate a writer, on a pool of nWorkers threads
+int runPool(int n, int writerRate, int nWorkers, int seed) {
+    pthread_t *workers = malloc(nWorkers * sizeof(pthread_t));
+    if (workers == NULL || roomInit(&room, ROOM_WRITERS)) {
+        abort();
+    }
+    nPeople = n;
+    draw(n, writerRate, seed);
+    fflush(stdout);
+    logStart(lines);
+    statsStart(n);
+    gettimeofday(&time0, NULL);
+    for (int i = 0; i < nWorkers; i++) {
+        int err = pthread_create(&workers[i], NULL, poolWorker, NULL);
+        if (err) { abort(); }
+    }
+    for (int i = 0; i < nWorkers; i++) {
+        int err = pthread_join(workers[i], NULL);
+        if (err) { abort(); }
+    }
+    logStop();
+    printf("Ran %i participants on %i threads in %i ticks.\n", n, nWorkers, tick());
+    statsEnd();
+    free(workers);
+    free(heap);
+    free(people);
+    return 0;
+}
+
+void usage(char *name) {
+    printf("Usage: %s [-s occupancy.csv] [virtual [participants [writer rate [seed]]]]\n", name);
+    printf("       %s [-s occupancy.csv] pool [participants [writer rate [threads [tick us]]]]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    //readingroom virtual [participants [writer rate [seed]]] runs in virtual time
+    //readingroom pool [participants [writer rate [threads [tick us]]]] on a pool of threads
+    //-s first keeps statistics, printed at the end with the occupancy written to the file
+    if (argc > 1 && !strcmp(argv[1], "-s")) {
+        if (argc < 3) {
+            usage(argv[0]);
+        }
+        statsFile = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc > 1) {
+        int n = argc > 2 ? atoi(argv[2]) : 100;
+        int rate = argc > 3 ? atoi(argv[3]) : 8;
+        //every participant may be waiting in the room's queue at once,
+        //as a reader or a writer, so stay within what the lock holds
+        if (n <= 0 || rate <= 0 || n > ROOM_MAX_READERS || n > ROOM_MAX_WRITERS) {
+            usage(argv[0]);
+        }
+        if (!strcmp(argv[1], "virtual")) {
+            return simulate(n, rate, argc > 4 ? atoi(argv[4]) : time(NULL) % 65536);
+        }
+        if (!strcmp(argv[1], "pool")) {
+            int workers = argc > 4 ? atoi(argv[4]) : 4;
+            tickUs = argc > 5 ? atoi(argv[5]) : 10000;
+            if (workers <= 0 || tickUs <= 0) {
+                usage(argv[0]);
+            }
+            return runPool(n, rate, workers, time(NULL) % 65536);
+        }
+        usage(argv[0]);
+    }
+
     /* You may add code of your own to main() if you want to, but this should not be necessary.
      * Do not change the code that is already here.
      * Note that currently the number of threads is 100 and the writer rate is 1/8.
@@ -291,7 +679,11 @@ int main(void) {
     int seed = time(NULL) % 65536;
     printf("Random seed: %i.\n", seed);
     srand(seed);
+    fflush(stdout);
+    logStart(lines);
     gettimeofday(&time0, NULL);
+    if (roomInit(&room, ROOM_WRITERS)) { abort(); }
+    statsStart(100);
 
     pthread_t threads[100];
     for (int i = 0; i < 100; i++) {
@@ -303,7 +695,7 @@ int main(void) {
         info->id = ++count;
         info->delay = (random() % 6) + (random() % 6) + 2;
         int isWriter = (random() % 8) == 0;
-        printf("id=%i isWriter = %i\n", i, isWriter);
+        logEvent(L_IS_WRITER, i, isWriter, 0, 0);
         info->thread=&threads[i];
         int err = pthread_create(&threads[i], NULL, isWriter ? writer : reader, info);
         if (err) { abort(); }
@@ -315,4 +707,6 @@ int main(void) {
         int err = pthread_join(threads[i], NULL);
         if (err) { abort(); }
     }
+    logStop();
+    statsEnd();
 }
@@ -0,0 +1,326 @@
+/*
+ * Benchmark of the reading room lock.
+ * Every thread count from 1 to 64 runs each writer ratio for a fixed
+ * time, entering the room as a reader or a writer at random and
+ * touching a small shared table inside. The first table compares the
+ * operations per second of the lock, with writers first, against
+ * pthread_rwlock_t. The second runs every policy of the lock and adds
+ * the longest time a reader and a writer waited to enter. The check
+ * mode instead counts who is in the room under every policy, with
+ * threads and with thousands of queued tasks, and fails if a writer
+ * ever shares it.
+ * use: ./roombench [milliseconds per run] [compare|policies|check]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include "roomlock.h"
+
+#define MAX_THREADS 64
+#define TABLE 8
+#define TASKS 20000            // queued tasks in the check, far more than threads
+
+// the locks under test behind one interface
+typedef struct lockOps {
+    const char *name;
+    int (*rdlock)(void *l);
+    int (*rdunlock)(void *l);
+    int (*wrlock)(void *l);
+    int (*wrunlock)(void *l);
+} LockOps;
+
+int roomRd(void *l){ return rdlock(l); }
+int roomRdUn(void *l){ return rdunlock(l); }
+int roomWr(void *l){ return wrlock(l); }
+int roomWrUn(void *l){ return wrunlock(l); }
+int posixRd(void *l){ return pthread_rwlock_rdlock(l); }
+int posixWr(void *l){ return pthread_rwlock_wrlock(l); }
+int posixUn(void *l){ return pthread_rwlock_unlock(l); }
+
+LockOps roomOps = {"room", roomRd, roomRdUn, roomWr, roomWrUn};
+LockOps posixOps = {"pthread", posixRd, posixUn, posixWr, posixUn};
+
+const char *policyNames[] = {"writers", "readers", "phase-fair", "fifo"};
+
+// one run: the lock, its operations and the share of writers in percent
+typedef struct run {
+    LockOps *ops;
+    void *lock;
+    int writePercent;
+    int timed;                 // measure how long each entry waited
+    volatile int stop;
+    long table[TABLE];
+} Run;
+
+typedef struct worker {
+    Run *run;
+    unsigned seed;
+    long ops;
+    long maxRead;              // longest waits to enter, in ns
+    long maxWrite;
+    pthread_t thread;
+} Worker;
+
+// what a run measured
+typedef struct result {
+    double opsPerSec;
+    long maxRead;
+    long maxWrite;
+} Result;
+
+/* xorshift, cheap enough not to show in the results */
+unsigned nextRandom(unsigned *s){
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+long clockNs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+void* bench(void *p){
+    Worker *w = p;
+    Run *r = w->run;
+    long sum = 0, start = 0, waited;
+    while(!r->stop){
+        if(r->timed){
+            start = clockNs();
+        }
+        if(nextRandom(&w->seed) % 100 < (unsigned) r->writePercent){
+            r->ops->wrlock(r->lock);
+            if(r->timed && (waited = clockNs() - start) > w->maxWrite){
+                w->maxWrite = waited;
+            }
+            for(int i = 0; i < TABLE; i++){
+                r->table[i]++;
+            }
+            r->ops->wrunlock(r->lock);
+        }
+        else{
+            r->ops->rdlock(r->lock);
+            if(r->timed && (waited = clockNs() - start) > w->maxRead){
+                w->maxRead = waited;
+            }
+            for(int i = 0; i < TABLE; i++){
+                sum += r->table[i];
+            }
+            r->ops->rdunlock(r->lock);
+        }
+        w->ops++;
+    }
+    return (void*) sum;
+}
+
+/* Run nthreads against the lock for ms milliseconds. */
+Result measure(LockOps *ops, void *lock, int nthreads, int writePercent, int ms, int timed){
+    Run r = {ops, lock, writePercent, timed, 0, {0}};
+    Worker w[MAX_THREADS];
+    struct timespec d = {ms / 1000, (ms % 1000) * 1000000L};
+    Result res = {0, 0, 0};
+    long total = 0;
+    for(int i = 0; i < nthreads; i++){
+        memset(&w[i], 0, sizeof(w[i]));
+        w[i].run = &r;
+        w[i].seed = 2463534242u + i;
+        if(pthread_create(&w[i].thread, NULL, bench, &w[i])){ abort(); }
+    }
+    nanosleep(&d, NULL);
+    r.stop = 1;
+    for(int i = 0; i < nthreads; i++){
+        if(pthread_join(w[i].thread, NULL)){ abort(); }
+        total += w[i].ops;
+        if(w[i].maxRead > res.maxRead){ res.maxRead = w[i].maxRead; }
+        if(w[i].maxWrite > res.maxWrite){ res.maxWrite = w[i].maxWrite; }
+    }
+    res.opsPerSec = total * 1000.0 / ms;
+    return res;
+}
+
+int ratios[] = {0, 1, 10, 50};
+#define NRATIOS ((int) (sizeof(ratios) / sizeof(ratios[0])))
+
+/* RoomLock with writers first against pthread_rwlock_t. */
+void compare(int ms){
+    RoomLock room;
+    pthread_rwlock_t posix;
+    if(roomInit(&room, ROOM_WRITERS) || pthread_rwlock_init(&posix, NULL)){ abort(); }
+    printf("%8s %8s %14s %14s\n", "threads", "writers", "room ops/s", "pthread ops/s");
+    for(int n = 1; n <= MAX_THREADS; n *= 2){
+        for(int i = 0; i < NRATIOS; i++){
+            Result a = measure(&roomOps, &room, n, ratios[i], ms, 0);
+            Result b = measure(&posixOps, &posix, n, ratios[i], ms, 0);
+            printf("%8d %7d%% %14.0f %14.0f\n", n, ratios[i], a.opsPerSec, b.opsPerSec);
+        }
+    }
+    roomDestroy(&room);
+    pthread_rwlock_destroy(&posix);
+}
+
+/* Throughput and worst case waits of every policy. */
+void policies(int ms){
+    RoomLock room;
+    printf("%12s %8s %8s %14s %14s %14s\n", "policy", "threads", "writers",
+           "ops/s", "max rd wait us", "max wr wait us");
+    for(int p = ROOM_WRITERS; p <= ROOM_FIFO; p++){
+        for(int n = 1; n <= MAX_THREADS; n *= 4){
+            for(int i = 1; i < NRATIOS; i++){
+                if(roomInit(&room, p)){ abort(); }
+                Result a = measure(&roomOps, &room, n, ratios[i], ms, 1);
+                printf("%12s %8d %7d%% %14.0f %14ld %14ld\n", policyNames[p], n, ratios[i],
+                       a.opsPerSec, a.maxRead / 1000, a.maxWrite / 1000);
+                roomDestroy(&room);
+            }
+        }
+    }
+}
+
+/* Who is in the room during a check, and how often the rules broke. */
+int readersIn = 0, writersIn = 0;
+long broken = 0;
+
+void enterChecked(int write){
+    if(write){
+        if(__atomic_add_fetch(&writersIn, 1, __ATOMIC_SEQ_CST) != 1 ||
+           __atomic_load_n(&readersIn, __ATOMIC_SEQ_CST)){
+            __atomic_add_fetch(&broken, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else{
+        __atomic_add_fetch(&readersIn, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&writersIn, __ATOMIC_SEQ_CST)){
+            __atomic_add_fetch(&broken, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void leaveChecked(int write){
+    __atomic_sub_fetch(write ? &writersIn : &readersIn, 1, __ATOMIC_SEQ_CST);
+}
+
+// one checking thread, entering with the blocking and the try calls
+void* checker(void *p){
+    Worker *w = p;
+    Run *r = w->run;
+    RoomLock *l = r->lock;
+    while(!r->stop){
+        unsigned x = nextRandom(&w->seed);
+        int write = x % 100 < (unsigned) r->writePercent, tryFirst = (x >> 8) % 4 == 0;
+        if(write){
+            if(!tryFirst || wrtrylock(l) == EBUSY){ wrlock(l); }
+        }
+        else if(!tryFirst || rdtrylock(l) == EBUSY){
+            rdlock(l);
+        }
+        enterChecked(write);
+        for(int i = 0; i < TABLE; i++){
+            r->table[i]++;
+        }
+        leaveChecked(write);
+        if(write){ wrunlock(l); } else { rdunlock(l); }
+        w->ops++;
+    }
+    return NULL;
+}
+
+// the tasks in the room, each let in by the room or at once
+struct roomWaiter *admitted[TASKS];
+int nAdmitted = 0;
+
+void admittedTask(struct roomWaiter *w){
+    enterChecked(w->write);
+    admitted[nAdmitted++] = w;
+}
+
+/* Queue TASKS readers and writers behind a reader and let them all through. */
+void checkTasks(RoomLock *l, unsigned seed){
+    static struct roomWaiter tasks[TASKS], first;
+    int left = TASKS;
+    // not rdlock, a writer task would wait for our fast read to end
+    if(rdlockAsync(l, &first, admittedTask)){ abort(); }
+    enterChecked(0);
+    for(int i = 0; i < TASKS; i++){
+        tasks[i].write = nextRandom(&seed) % 2;
+        if((tasks[i].write ? wrlockAsync(l, &tasks[i], admittedTask)
+                           : rdlockAsync(l, &tasks[i], admittedTask)) == 0){
+            admittedTask(&tasks[i]);
+        }
+    }
+    leaveChecked(0);
+    rdunlockAsync(l);
+    // the tasks leave one at a time, letting the next ones in
+    while(nAdmitted > 0){
+        struct roomWaiter *w = admitted[--nAdmitted];
+        leaveChecked(w->write);
+        if(w->write){ wrunlock(l); } else { rdunlockAsync(l); }
+        left--;
+    }
+    if(left > 0){
+        printf("%d tasks never got in\n", left);
+        broken++;
+    }
+}
+
+/* Check the room's rules under every policy, returns 1 if they broke. */
+int check(int ms){
+    RoomLock room;
+    for(int p = ROOM_WRITERS; p <= ROOM_FIFO; p++){
+        for(int n = 2; n <= MAX_THREADS; n *= 4){
+            for(int i = 1; i < NRATIOS; i++){
+                Run r = {NULL, &room, ratios[i], 0, 0, {0}};
+                Worker w[MAX_THREADS];
+                struct timespec d = {ms / 1000, (ms % 1000) * 1000000L};
+                long ops = 0;
+                if(roomInit(&room, p)){ abort(); }
+                for(int t = 0; t < n; t++){
+                    memset(&w[t], 0, sizeof(w[t]));
+                    w[t].run = &r;
+                    w[t].seed = 2463534242u + t;
+                    if(pthread_create(&w[t].thread, NULL, checker, &w[t])){ abort(); }
+                }
+                nanosleep(&d, NULL);
+                r.stop = 1;
+                for(int t = 0; t < n; t++){
+                    if(pthread_join(w[t].thread, NULL)){ abort(); }
+                    ops += w[t].ops;
+                }
+                printf("%12s %8d threads %7d%% writers %10ld entries, %ld broken\n",
+                       policyNames[p], n, ratios[i], ops, broken);
+                if(roomDestroy(&room)){ broken++; }
+            }
+        }
+        if(roomInit(&room, p)){ abort(); }
+        checkTasks(&room, 2463534242u + p);
+        printf("%12s %8d tasks   queued at once, %ld broken\n", policyNames[p], TASKS, broken);
+        if(roomDestroy(&room)){ broken++; }
+    }
+    printf(broken ? "check failed\n" : "check passed\n");
+    return broken != 0;
+}
+
+int main(int argc, char **argv){
+    int ms = argc > 1 ? atoi(argv[1]) : 200;
+    const char *which = argc > 2 ? argv[2] : NULL;
+    if(ms <= 0 || (which != NULL && strcmp(which, "compare") && strcmp(which, "policies") &&
+                   strcmp(which, "check"))){
+        printf("Usage: %s [milliseconds per run] [compare|policies|check]\n", argv[0]);
+        exit(1);
+    }
+    if(which != NULL && !strcmp(which, "check")){
+        return check(ms);
+    }
+    if(which == NULL || !strcmp(which, "compare")){
+        compare(ms);
+    }
+    if(which == NULL || !strcmp(which, "policies")){
+        policies(ms);
+    }
+    return 0;
+}
@@ -0,0 +1,577 @@
+/*
+ * The reading room lock, one word holding the readers in the room,
+ * the writers waiting, a writer bit and a bit telling that the wait
+ * queue isn't empty. Entering and leaving without contention is a
+ * single atomic operation on the word.
+ * Threads that have to wait join a FIFO queue, guarded by a spin
+ * word, and sleep on their own parking slot. Whoever frees the room
+ * hands it over: it updates the word for the threads it lets in and
+ * wakes exactly those, a writer or a batch of readers, so nobody
+ * wakes up only to wait again.
+ * Who goes next is the lock's policy, chosen at init: writers first
+ * as in the reading room, readers first, phase-fair, where readers
+ * waiting behind a writer all go in after it before the next writer,
+ * or strictly in order of arrival.
+ * On top of it is a reader bias in the manner of BRAVO: while the bias is on,
+ * a reader enters by claiming its thread's slot of the lock, on a
+ * cache line of its own, and never touches the lock word. A writer
+ * turns the bias off and waits for the lock's slots to empty, sleeping
+ * on a slot whose reader stays long, and
+ * the bias stays off for a while after, in proportion to how long
+ * that wait took, so writer-heavy locks don't keep paying for it.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "roomlock.h"
+
+#define INHIBIT 9              // bias stays off INHIBIT times as long as revoking took
+#define RESTORE_EVERY 16       // slow reads between looks at the clock to restore the bias
+#define MAX_FAST 8             // fast path reads a thread may hold at once
+#define SPIN 100               // tries at the queue guard before yielding
+#define YIELDS 16              // times a thread yields for the room before queueing, or for a fast reader before sleeping
+
+// a slot's held, SLOT_WAITED once a writer sleeps until its reader leaves
+#define SLOT_WAITED 2
+// rbias while off with fast readers maybe still in, the next writer drains them
+#define UNDRAINED 2
+
+// the fields of the lock word
+#define READER 1ul
+#define READERS 0x3ffffffful                  // up to ROOM_MAX_READERS
+#define WAITER (1ul << 30)
+#define WAITERS 0x3fffffffc0000000ul         // up to ROOM_MAX_WRITERS, never carries into WRITER
+#define WRITER (1ul << 62)
+#define QUEUED (1ul << 63)
+
+// the slots this thread holds, to tell its fast reads from slow ones
+__thread struct {
+    RoomLock *lock;
+    int slot;
+} fastReads[MAX_FAST];
+__thread int nFastReads = 0;
+__thread unsigned slowReads = 0;
+// where this thread sleeps while it waits for a room
+__thread struct roomWaiter parking;
+__thread int selfId = -1;
+int nThreads = 0;
+
+long nowNs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+int slotOf(){
+    if(selfId < 0){
+        selfId = __atomic_fetch_add(&nThreads, 1, __ATOMIC_RELAXED);
+    }
+    return selfId % ROOM_SLOTS;
+}
+
+/* Free a slot, waking the writers that sleep on it. */
+void leaveSlot(RoomLock *l, int slot){
+    if(__atomic_exchange_n(&l->slots[slot].held, 0, __ATOMIC_RELEASE) == SLOT_WAITED){
+        syscall(SYS_futex, &l->slots[slot].held, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/* Try to enter through a slot, returns 1 if the reader is in. */
+int fastRead(RoomLock *l){
+    int slot, none = 0;
+    if(__atomic_load_n(&l->rbias, __ATOMIC_RELAXED) != 1 || nFastReads == MAX_FAST){
+        return 0;
+    }
+    // taken by another thread sharing it, or by this one reading already
+    slot = slotOf();
+    if(!__atomic_compare_exchange_n(&l->slots[slot].held, &none, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+        return 0;
+    }
+    // a writer that turned the bias off meanwhile may not have seen the slot
+    if(__atomic_load_n(&l->rbias, __ATOMIC_SEQ_CST) != 1){
+        leaveSlot(l, slot);
+        return 0;
+    }
+    fastReads[nFastReads].lock = l;
+    fastReads[nFastReads].slot = slot;
+    nFastReads++;
+    return 1;
+}
+
+/* Leave through the slot if the read came in through one, returns 1 if so. */
+int fastUnread(RoomLock *l){
+    for(int i = nFastReads - 1; i >= 0; i--){
+        if(fastReads[i].lock == l){
+            leaveSlot(l, fastReads[i].slot);
+            fastReads[i] = fastReads[--nFastReads];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Turn the bias on again after a slow read, once the inhibit time is over
+ * and unless a writer waits. Only every few slow reads look at the
+ * clock, the rest stay slow a little longer. A writer that came
+ * meanwhile revokes it again once it is in the room, before touching
+ * anything.
+ */
+void restoreBias(RoomLock *l){
+    if(__atomic_load_n(&l->rbias, __ATOMIC_RELAXED) != 1 && ++slowReads % RESTORE_EVERY == 0
+       && nowNs() >= __atomic_load_n(&l->inhibitUntil, __ATOMIC_RELAXED)
+       && !(__atomic_load_n(&l->state, __ATOMIC_RELAXED) & WAITERS)){
+        __atomic_store_n(&l->rbias, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Turn the bias off, returns nonzero if it was on or left undrained. */
+int revokeBias(RoomLock *l){
+    return __atomic_exchange_n(&l->rbias, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Wait for the fast readers to leave, after revoking the bias. One
+ * that stays in for more than a few yields is slept on, its slot
+ * marked so that it wakes us when it leaves.
+ */
+void drainReaders(RoomLock *l){
+    long start = nowNs(), end;
+    int held;
+    for(int i = 0; i < ROOM_SLOTS; i++){
+        for(int n = 0; (held = __atomic_load_n(&l->slots[i].held, __ATOMIC_SEQ_CST)); n++){
+            if(n < YIELDS){
+                sched_yield();
+            }
+            else if(held == SLOT_WAITED ||
+                    __atomic_compare_exchange_n(&l->slots[i].held, &held, SLOT_WAITED, 0,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+                syscall(SYS_futex, &l->slots[i].held, FUTEX_WAIT_PRIVATE, SLOT_WAITED, NULL, NULL, 0);
+            }
+        }
+    }
+    end = nowNs();
+    __atomic_store_n(&l->inhibitUntil, end + (end - start) * INHIBIT, __ATOMIC_RELAXED);
+}
+
+/* Count the fast readers in the room. */
+int fastReaders(RoomLock *l){
+    int n = 0;
+    for(int i = 0; i < ROOM_SLOTS; i++){
+        n += __atomic_load_n(&l->slots[i].held, __ATOMIC_RELAXED) != 0;
+    }
+    return n;
+}
+
+void lockQueue(RoomLock *l){
+    int n = 0;
+    while(__atomic_exchange_n(&l->guard, 1, __ATOMIC_ACQUIRE)){
+        if(++n % SPIN == 0){
+            sched_yield();
+        }
+    }
+    if(l->stats != NULL){
+        l->guardSince = nowNs();
+    }
+}
+
+void unlockQueue(RoomLock *l){
+    struct roomStats *s = l->stats;
+    // counted while still holding the guard, so the counts need no atomics
+    if(s != NULL){
+        long held = nowNs() - l->guardSince;
+        int b = held > 1 ? 63 - __builtin_clzl(held) : 0;
+        s->guardHeld[b < ROOM_BUCKETS ? b : ROOM_BUCKETS - 1]++;
+        s->guardTotal += held;
+        if(held > s->guardMax){
+            s->guardMax = held;
+        }
+    }
+    __atomic_store_n(&l->guard, 0, __ATOMIC_RELEASE);
+}
+
+/* Count a wakeup, useful or not. */
+void countWakeup(RoomLock *l, int useful){
+    struct roomStats *s = __atomic_load_n(&l->stats, __ATOMIC_RELAXED);
+    if(s != NULL){
+        __atomic_add_fetch(useful ? &s->wakeups : &s->spurious, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Let in whoever may enter now, under the queue guard, as the
+ * policy says: a writer once the room is empty, or readers while no
+ * writer is in it. The word is updated for them before they are
+ * unlinked. Returns the threads let in, chained through next.
+ */
+struct roomWaiter *admit(RoomLock *l){
+    struct roomWaiter *w, **at, *in, **last;
+    unsigned long s = __atomic_load_n(&l->state, __ATOMIC_RELAXED), next;
+    int first, before, readers, queued, write;
+    while(1){
+        if(l->head == NULL || (s & WRITER)){
+            return NULL;
+        }
+        // the queue: where the first writer is, the readers ahead of it and in all
+        first = -1;
+        before = readers = queued = 0;
+        for(w = l->head; w != NULL; w = w->next, queued++){
+            if(w->write && first < 0){
+                first = queued;
+                before = readers;
+            }
+            readers += !w->write;
+        }
+        if(first < 0){
+            before = readers;
+        }
+        switch(l->policy){
+        case ROOM_FIFO:
+            // whoever is at the head, with the readers right behind it
+            write = first == 0;
+            readers = before;
+            break;
+        case ROOM_READERS:
+            write = readers == 0;
+            break;
+        case ROOM_PHASE_FAIR:
+            // after a writer every reader that waited goes in together
+            if(l->writerLeft && readers > 0){
+                write = 0;
+                break;
+            }
+            // fall through, otherwise it is as with writers first
+        case ROOM_WRITERS:
+        default:
+            write = first >= 0;
+            // a writer that hasn't queued yet still keeps the readers out
+            if(!write && (s & WAITERS)){
+                return NULL;
+            }
+        }
+        if(write){
+            if(s & READERS){
+                return NULL;
+            }
+            next = (s - WAITER) | WRITER;
+            if(queued == 1){
+                next &= ~QUEUED;
+            }
+        }
+        else{
+            next = s + readers * READER;
+            if(readers == queued){
+                next &= ~QUEUED;
+            }
+        }
+        if(__atomic_compare_exchange_n(&l->state, &s, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+            break;
+        }
+    }
+    // unlink the first writer, or the first readers
+    in = NULL;
+    last = &in;
+    for(at = &l->head; *at != NULL && (write ? in == NULL : readers > 0); ){
+        w = *at;
+        if(w->write == write){
+            *at = w->next;
+            w->next = NULL;
+            *last = w;
+            last = &w->next;
+            readers--;
+        }
+        else{
+            at = &w->next;
+        }
+    }
+    for(l->tail = NULL, w = l->head; w != NULL; w = w->next){
+        l->tail = w;
+    }
+    l->writerLeft = 0;
+    return in;
+}
+
+void wake(struct roomWaiter *in){
+    struct roomWaiter *next;
+    for(; in != NULL; in = next){
+        next = in->next;
+        if(in->resume != NULL){
+            // the writer may still have fast readers to wait for
+            if(in->write && revokeBias(in->lock)){
+                drainReaders(in->lock);
+            }
+            countWakeup(in->lock, 1);
+            __atomic_store_n(&in->ready, 1, __ATOMIC_RELEASE);
+            in->resume(in);
+            continue;
+        }
+        // once ready is set the waiter may leave, don't touch it after
+        __atomic_store_n(&in->ready, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &in->ready, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/* Hand the room to the waiters that may enter, after leaving it. */
+void handOff(RoomLock *l, int writer){
+    struct roomWaiter *in;
+    lockQueue(l);
+    if(writer){
+        l->writerLeft = 1;
+    }
+    in = admit(l);
+    unlockQueue(l);
+    wake(in);
+}
+
+/* Enter if the room is open to us and nobody is queued, a writer
+ * is already counted as waiting. Returns 1 if we are in.
+ */
+int enter(RoomLock *l, int write){
+    unsigned long s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+    do{
+        if(s & (write ? l->writeBlock | QUEUED : l->readBlock)){
+            return 0;
+        }
+    }while(!__atomic_compare_exchange_n(&l->state, &s, write ? (s - WAITER) | WRITER : s + READER, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/* Put w at the end of the queue, it may be let in straight away. */
+void join(RoomLock *l, struct roomWaiter *w){
+    struct roomWaiter *in;
+    unsigned long s;
+    w->ready = 0;
+    w->next = NULL;
+    lockQueue(l);
+    s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&l->state, &s, s | QUEUED, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if(l->tail == NULL){
+        l->head = w;
+    }
+    else{
+        l->tail->next = w;
+    }
+    l->tail = w;
+    // the room may have freed up before we were queued
+    in = admit(l);
+    unlockQueue(l);
+    wake(in);
+}
+
+/* Join the queue and sleep until someone lets us in, the word is
+ * already updated for us by then. A short wait is cheaper than a
+ * handoff, so first give the holders a few chances to leave, unless
+ * the queue is what keeps us out: it only empties through handoffs,
+ * and yielding for it just takes the processor from whoever holds
+ * the room.
+ */
+void waitTurn(RoomLock *l, int write){
+    struct roomWaiter *me = &parking;
+    unsigned long queued = write ? QUEUED : l->readBlock & QUEUED;
+    for(int i = 0; i < YIELDS; i++){
+        if(__atomic_load_n(&l->state, __ATOMIC_RELAXED) & queued){
+            break;
+        }
+        sched_yield();
+        if(enter(l, write)){
+            return;
+        }
+    }
+    me->write = write;
+    me->resume = NULL;
+    join(l, me);
+    while(!__atomic_load_n(&me->ready, __ATOMIC_ACQUIRE)){
+        syscall(SYS_futex, &me->ready, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+        countWakeup(l, __atomic_load_n(&me->ready, __ATOMIC_ACQUIRE));
+    }
+}
+
+int roomInit(RoomLock *l, enum ROOM_POLICY policy){
+    l->policy = policy;
+    switch(policy){
+    case ROOM_WRITERS:
+    case ROOM_PHASE_FAIR:
+        l->readBlock = WRITER | WAITERS;
+        break;
+    case ROOM_READERS:
+        l->readBlock = WRITER;
+        break;
+    case ROOM_FIFO:
+        l->readBlock = WRITER | WAITERS | QUEUED;
+        break;
+    default:
+        return EINVAL;
+    }
+    l->writeBlock = WRITER | READERS;
+    l->writerLeft = 0;
+    l->state = 0;
+    l->guard = 0;
+    l->head = NULL;
+    l->tail = NULL;
+    l->rbias = 1;
+    l->inhibitUntil = 0;
+    l->stats = NULL;
+    for(int i = 0; i < ROOM_SLOTS; i++){
+        l->slots[i].held = 0;
+    }
+    return 0;
+}
+
+int roomDestroy(RoomLock *l){
+    if(__atomic_load_n(&l->state, __ATOMIC_RELAXED)){
+        return EBUSY;
+    }
+    return 0;
+}
+
+int rdlock(RoomLock *l){
+    if(fastRead(l)){
+        return 0;
+    }
+    unsigned long s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+    do{
+        // a writer in the room keeps readers out, and as the policy says a waiting one
+        if(s & l->readBlock){
+            waitTurn(l, 0);
+            break;
+        }
+    }while(!__atomic_compare_exchange_n(&l->state, &s, s + READER, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    restoreBias(l);
+    return 0;
+}
+
+int rdtrylock(RoomLock *l){
+    if(fastRead(l)){
+        return 0;
+    }
+    unsigned long s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+    do{
+        if(s & l->readBlock){
+            return EBUSY;
+        }
+    }while(!__atomic_compare_exchange_n(&l->state, &s, s + READER, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    restoreBias(l);
+    return 0;
+}
+
+int rdunlock(RoomLock *l){
+    if(fastUnread(l)){
+        return 0;
+    }
+    unsigned long s = __atomic_sub_fetch(&l->state, READER, __ATOMIC_RELEASE);
+    // the last reader out hands the room to the first waiting writer
+    if(!(s & READERS) && (s & QUEUED)){
+        handOff(l, 0);
+    }
+    return 0;
+}
+
+int wrlock(RoomLock *l){
+    unsigned long s = 0;
+    int biased = 0;
+    if(!__atomic_compare_exchange_n(&l->state, &s, WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        // stop new readers, slow ones through the count and fast ones
+        // through the bias, readers can't turn it on while we wait
+        __atomic_add_fetch(&l->state, WAITER, __ATOMIC_RELAXED);
+        biased = revokeBias(l);
+        waitTurn(l, 1);
+    }
+    // a reader may have turned the bias on before it saw us waiting
+    if(revokeBias(l) || biased){
+        drainReaders(l);
+    }
+    return 0;
+}
+
+int wrtrylock(RoomLock *l){
+    unsigned long s = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+    do{
+        // don't overtake anyone already waiting
+        if(s & (l->writeBlock | WAITERS | QUEUED)){
+            return EBUSY;
+        }
+    }while(!__atomic_compare_exchange_n(&l->state, &s, s | WRITER, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    // with the bias off no fast reader can come in behind us, if
+    // some are in it stays off so none enter while a writer that came
+    // meanwhile waits, and whichever writer is next drains them
+    if(revokeBias(l) && fastReaders(l)){
+        __atomic_store_n(&l->rbias, UNDRAINED, __ATOMIC_SEQ_CST);
+        wrunlock(l);
+        return EBUSY;
+    }
+    return 0;
+}
+
+int wrunlock(RoomLock *l){
+    unsigned long s = __atomic_fetch_and(&l->state, ~WRITER, __ATOMIC_RELEASE);
+    // the policy picks the next writer or the waiting readers
+    if(s & QUEUED){
+        handOff(l, 1);
+    }
+    return 0;
+}
+
+int roomCount(RoomLock *l, struct roomStats *s){
+    // under the guard, so no guard hold is timed by one stats and counted in another
+    lockQueue(l);
+    __atomic_store_n(&l->stats, s, __ATOMIC_RELAXED);
+    if(s != NULL){
+        l->guardSince = nowNs();
+    }
+    unlockQueue(l);
+    return 0;
+}
+
+int roomReaders(RoomLock *l){
+    return (__atomic_load_n(&l->state, __ATOMIC_RELAXED) & READERS) + fastReaders(l);
+}
+
+int rdlockAsync(RoomLock *l, struct roomWaiter *w, void (*resume)(struct roomWaiter *w)){
+    // no fast path, the read may be left from another thread
+    if(enter(l, 0)){
+        return 0;
+    }
+    w->write = 0;
+    w->lock = l;
+    w->resume = resume;
+    join(l, w);
+    return EINPROGRESS;
+}
+
+int rdunlockAsync(RoomLock *l){
+    unsigned long s = __atomic_sub_fetch(&l->state, READER, __ATOMIC_RELEASE);
+    if(!(s & READERS) && (s & QUEUED)){
+        handOff(l, 0);
+    }
+    return 0;
+}
+
+int wrlockAsync(RoomLock *l, struct roomWaiter *w, void (*resume)(struct roomWaiter *w)){
+    unsigned long s = 0;
+    if(!__atomic_compare_exchange_n(&l->state, &s, WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        __atomic_add_fetch(&l->state, WAITER, __ATOMIC_RELAXED);
+        // the fast readers leave on their own, without a handoff
+        if(revokeBias(l)){
+            drainReaders(l);
+        }
+        if(!enter(l, 1)){
+            w->write = 1;
+            w->lock = l;
+            w->resume = resume;
+            join(l, w);
+            return EINPROGRESS;
+        }
+    }
+    if(revokeBias(l)){
+        drainReaders(l);
+    }
+    return 0;
+}
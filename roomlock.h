@@ -0,0 +1,106 @@
+/* Header file for the reading room lock.
+ * A reader/writer lock with the rules of the reading room: any number
+ * of readers may be in the room together, a writer only alone, and
+ * with the ROOM_WRITERS policy, once a writer is waiting no more
+ * readers may enter until the waiting writers have had their turn.
+ * Other policies trade this for reader throughput or fairness.
+ * Readers are biased: while no writer comes, they enter through
+ * per-thread slots of the lock, each on its own cache line, and don't
+ * contend with each other.
+ * The lock is one 64-bit word and a wait queue, it holds up to
+ * ROOM_MAX_READERS slow readers and ROOM_MAX_WRITERS waiting writers
+ * at a time, more than threads or tasks can wait in practice.
+ * Every function returns 0 on success or an error number, like the
+ * pthread functions.
+ */
+
+#ifndef _roomlock_h_
+#define _roomlock_h_
+
+#define ROOM_MAX_READERS ((1L << 30) - 1)
+#define ROOM_MAX_WRITERS ((1L << 32) - 1)
+
+// who goes first when readers and writers are waiting
+enum ROOM_POLICY {
+    ROOM_WRITERS,     // waiting writers keep readers out, the reading room rules
+    ROOM_READERS,     // readers enter whenever no writer is in, writers may starve
+    ROOM_PHASE_FAIR,  // readers and writers take turns, nobody waits more than a phase of each
+    ROOM_FIFO         // strictly in order of arrival, readers in a row enter together
+};
+
+#define ROOM_SLOTS 64      // fast reader slots per lock, threads beyond share them
+#define ROOM_BUCKETS 32    // histogram buckets, bucket i counts times from 2^i to 2^(i+1) - 1 ns
+
+// what a lock counts while counting is on, see roomCount
+struct roomStats {
+    long wakeups;                  // a waiter woke up let in, or a task was resumed
+    long spurious;                 // a waiter woke up and had to sleep again
+    long guardHeld[ROOM_BUCKETS];  // how long the wait queue's guard was held
+    long guardTotal;               // in ns
+    long guardMax;
+};
+
+// a thread waiting for the room, each thread has its own, or a
+// task waiting through the Async functions
+struct roomWaiter {
+    struct roomWaiter *next;
+    int write;                   // 1 if waiting to write
+    unsigned ready;              // set by the thread that lets it in
+    void (*resume)(struct roomWaiter *w);  // called instead of a wakeup for a task
+    struct roomLock *lock;
+};
+
+typedef struct roomLock {
+    unsigned long state;         // readers in, writers waiting, writer in and queued bits
+    enum ROOM_POLICY policy;
+    unsigned long readBlock;     // the state bits that keep a reader out under the policy
+    unsigned long writeBlock;
+    int writerLeft;              // a writer left since the last handoff
+    int guard;                   // spin word guarding the wait queue
+    struct roomWaiter *head;     // the wait queue, first come first
+    struct roomWaiter *tail;
+    int rbias;                   // 1 while readers may enter through the slots, 2 while off but not drained
+    long inhibitUntil;           // the bias stays off until then, in ns
+    struct roomStats *stats;     // where to count, NULL when not counting
+    long guardSince;             // when the guard was taken, while counting
+    struct {
+        int held;                // nonzero while a fast reader is in through it
+    } __attribute__((aligned(64))) slots[ROOM_SLOTS];
+} RoomLock;
+
+// EINVAL for an unknown policy
+int roomInit(RoomLock *l, enum ROOM_POLICY policy);
+int roomDestroy(RoomLock *l);
+
+// enter and leave the room as a reader
+int rdlock(RoomLock *l);
+int rdunlock(RoomLock *l);
+
+// enter and leave the room as a writer
+int wrlock(RoomLock *l);
+int wrunlock(RoomLock *l);
+
+// enter without waiting, EBUSY if the caller would have to wait
+int rdtrylock(RoomLock *l);
+int wrtrylock(RoomLock *l);
+
+// enter for a task that must not block the thread running it, such
+// as a state machine on a pool of threads: 0 if it entered, otherwise
+// EINPROGRESS and w joined the queue, resume(w) is called by the
+// thread that lets it in, possibly before this returns
+// w must stay valid until then
+int rdlockAsync(RoomLock *l, struct roomWaiter *w, void (*resume)(struct roomWaiter *w));
+int wrlockAsync(RoomLock *l, struct roomWaiter *w, void (*resume)(struct roomWaiter *w));
+
+// leave after rdlockAsync, from any thread, writers leave with wrunlock
+int rdunlockAsync(RoomLock *l);
+
+// count into s from now on, s zeroed by the caller, or stop counting
+// if s is NULL; the counts are exact only once no thread uses the lock
+int roomCount(RoomLock *l, struct roomStats *s);
+
+// the number of readers in the room, only a hint unless the caller
+// holds the room as a writer
+int roomReaders(RoomLock *l);
+
+#endif
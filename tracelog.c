@@ -0,0 +1,174 @@
+/*
+ * The trace logger: a single producer, single consumer ring per
+ * thread and a drainer thread merging them by timestamp.
+ * Each round the drainer reads the clock first and then prints, in
+ * timestamp order, the events stamped before it. A thread sets its
+ * busy flag before reading the clock for an event and clears it once
+ * the event is published, so the drainer waits for busy threads: any
+ * event it hasn't seen yet will be stamped after its clock reading.
+ * A thread that exits gives its ring up and the next new thread takes
+ * it over, after the events left in it, so the drainer only scans as
+ * many rings as threads ever logged at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "tracelog.h"
+
+#define RING 1024          // events per thread, a power of two
+#define DRAIN_US 1000      // the drainer's pause when there is nothing to print
+
+struct traceEvent {
+    long stamp;            // ns on the monotonic clock
+    int line;
+    int args[LOG_ARGS];
+};
+
+struct ring {
+    unsigned long head;    // next event to print, moved by the drainer
+    unsigned long tail;    // next free slot, moved by the owner
+    int busy;              // the owner is logging an event
+    int owned;             // a live thread logs into it
+    struct ring *next;
+    struct traceEvent events[RING];
+};
+
+struct ring *rings = NULL;         // every thread's ring, pushed at its first event
+__thread struct ring *mine = NULL;
+pthread_key_t ringKey;             // gives the ring up when its thread exits
+pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+const char *const *lineFormats;
+pthread_t drainer;
+int stopping = 0;
+
+long stampNs(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+void releaseRing(void *p){
+    struct ring *r = p;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+void makeRingKey(){
+    if(pthread_key_create(&ringKey, releaseRing)){
+        abort();
+    }
+}
+
+/* Take over a ring given up by an exited thread, or add a new one. */
+struct ring *ownRing(){
+    struct ring *r;
+    int free;
+    pthread_once(&ringKeyOnce, makeRingKey);
+    for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next){
+        free = 0;
+        if(__atomic_compare_exchange_n(&r->owned, &free, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            break;
+        }
+    }
+    if(r == NULL){
+        r = calloc(1, sizeof(struct ring));
+        if(r == NULL){
+            abort();
+        }
+        r->owned = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    if(pthread_setspecific(ringKey, r)){
+        abort();
+    }
+    return r;
+}
+
+void logEvent(int line, int a, int b, int c, int d){
+    struct ring *r = mine;
+    struct traceEvent *e;
+    if(r == NULL){
+        r = mine = ownRing();
+    }
+    // a full ring waits for the drainer rather than lose lines
+    while(r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING){
+        sched_yield();
+    }
+    __atomic_store_n(&r->busy, 1, __ATOMIC_SEQ_CST);
+    e = &r->events[r->tail % RING];
+    e->stamp = stampNs();
+    e->line = line;
+    e->args[0] = a;
+    e->args[1] = b;
+    e->args[2] = c;
+    e->args[3] = d;
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Print the events stamped before now in order, returns how many. */
+int drain(){
+    struct ring *r, *first;
+    struct traceEvent *e;
+    long limit = stampNs();
+    int n = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next){
+        while(__atomic_load_n(&r->busy, __ATOMIC_ACQUIRE)){
+            sched_yield();
+        }
+    }
+    while(1){
+        first = NULL;
+        for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next){
+            if(r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)){
+                continue;
+            }
+            e = &r->events[r->head % RING];
+            if(e->stamp < limit && (first == NULL || e->stamp < first->events[first->head % RING].stamp)){
+                first = r;
+            }
+        }
+        if(first == NULL){
+            break;
+        }
+        e = &first->events[first->head % RING];
+        printf(lineFormats[e->line], e->args[0], e->args[1], e->args[2], e->args[3]);
+        __atomic_store_n(&first->head, first->head + 1, __ATOMIC_RELEASE);
+        n++;
+    }
+    return n;
+}
+
+void* drainLoop(void *p){
+    struct timespec pause = {0, DRAIN_US * 1000};
+    while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+        if(drain() == 0){
+            fflush(stdout);
+            nanosleep(&pause, NULL);
+        }
+    }
+    drain();
+    fflush(stdout);
+    return NULL;
+}
+
+void logStart(const char *const *formats){
+    lineFormats = formats;
+    if(pthread_create(&drainer, NULL, drainLoop, NULL)){
+        abort();
+    }
+}
+
+void logStop(){
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    if(pthread_join(drainer, NULL)){
+        abort();
+    }
+    // the rings stay, threads keep pointing at theirs
+    stopping = 0;
+}
@@ -0,0 +1,31 @@
+/* Header file for the trace logger.
+ * Threads log binary events, a line number and up to LOG_ARGS ints,
+ * into a ring buffer of their own without taking any lock, and a
+ * background thread formats them with printf. Lines come out in the
+ * order their events were logged, across all threads.
+ */
+
+#ifndef _tracelog_h_
+#define _tracelog_h_
+
+#define LOG_ARGS 4
+
+/*
+ * Start the background thread. formats holds a printf format for each
+ * line number, taking up to LOG_ARGS ints.
+ */
+void logStart(const char *const *formats);
+
+/*
+ * Log line with its arguments, the unused ones are ignored.
+ * Blocks only while the thread's ring is full.
+ */
+void logEvent(int line, int a, int b, int c, int d);
+
+/*
+ * Print every event logged so far and stop the background thread.
+ * PRE: no thread logs anymore.
+ */
+void logStop();
+
+#endif